@@ -1,26 +1,72 @@
 #include "_kernelCore.h"
+#include "_schedCore.h"
 #include <stdio.h>
 #include "led.h"
 
 //task management: We are using an array of tasks, so we can use a single index variable to choose which one runs
 int osCurrentTask = 0;
 
+/*
+	What PendSV works from. osCurrentTCB is the thread whose registers are on the CPU right now, and osNextTCB is the one the
+	scheduler last picked. PendSV saves the stack pointer into the first one, makes the second one current and loads its
+	stack pointer, without ever needing to know about osCurrentTask. If osCurrentTCB is NULL there is nothing worth saving.
+*/
+thread* osCurrentTCB = NULL;
+thread* osNextTCB = NULL;
+
 //I am using a static array of tasks. Feel free to do something more interesting
 thread osThreads[OS_IDLE_TASK];
 
+/*
+	The timer list. Every thread with a timeout pending is in here, sorted by when it expires, and each one
+	only stores how many ticks it expires after the one in front of it. SysTick then only ever has to
+	decrement the head: everything behind it moves along for free.
+*/
+int osTimerHead = NO_THREAD;
+
 /*
 	These next two variables are useful but in Lab Project 3 they do the
 	exact same thing. Eventually, when I start and put tasks into a BLOCKED state,
 	the number of threads we have and the number of threads running will not be the same.
 */
-int threadNums = 0; //number of threads actually created
+int threadNums = 0; //how many slots have ever been handed out. Every thread that exists has an id below this
 int osNumThreadsRunning = 0; //number of threads that have started running
 
+/*
+	The free list. Slots with no thread in them are linked through their "next" fields, since they aren't on any ready queue,
+	and a new thread takes whichever one is at the head. A slot's stack goes back to the stack arena when the slot is freed.
+*/
+int osFreeHead = NO_THREAD;
+
+//set once osKernelStart gets going. From then on threads are created and exit while others are running
+bool osKernelRunning = false;
+
+//cleared by admission control when a thread gets in that breaks the schedulability test. See _schedCore.c
+extern bool osTaskSetSchedulable;
+
 // Defining variables for mutex
 extern thread threadQueue[MAX_THREADS];
-extern mutex osMutexes[MAX_THREADS];
+mutex osMutexes[MAX_THREADS];
 int mutexNums = 0;
 
+#if OS_SRP
+/*
+	SRP state. The system ceiling is the highest ceiling of the mutexes that are held right now, and osCeilingOwner is the
+	thread holding the one that set it. Mutexes are released in the opposite order they are taken, so each mutex keeps what
+	these were before it, and osLockTop is the one that has to be released next.
+*/
+uint32_t osSystemCeiling = 0;
+int osCeilingOwner = NO_THREAD;
+static int osLockTop = NO_THREAD;
+
+/*
+	The shared stack. Shared-stack jobs always finish in the opposite order they started (SRP and EDF make sure of it), so
+	their frames are stacked on top of each other in here, and osSharedTop is the job on top. A uint64_t array keeps it 8-byte aligned
+*/
+static uint64_t osSharedStack[OS_SHARED_STACK_SIZE / 8];
+int osSharedTop = NO_THREAD;
+#endif
+
 
 //Having access to the MSP's initial value is important for setting the threads
 uint32_t mspAddr; //the initial address of the MSP
@@ -32,6 +78,12 @@ uint32_t mspAddr; //the initial address of the MSP
 */
 bool sysTickSwitchOK = true;
 
+//the number of ticks since the kernel started. Tickless idle adds the ticks it slept through back in
+volatile uint32_t osTickCount = 0;
+
+//how often we switch threads, and how often a preemption threshold saved us a switch
+switchStats osSwitchStats = {0};
+
 /*
 	Performs various initialization tasks.
 	It needs to:
@@ -53,12 +105,153 @@ void kernelInit(void)
 	uint32_t* MSP_Original = 0;
 	mspAddr = *MSP_Original;
 	
-	//initialize the thread periods
+	//initialize the thread periods, and put every slot on the free list in order so that the first thread created is 0
 	for(int i = 0; i < MAX_THREADS; i++)
+	{
 		osThreads[i].period = UNITIALIZED_THREAD_PERIOD;
+		osThreads[i].status = DESTROYED;
+		osThreads[i].next = (i + 1 < MAX_THREADS) ? i + 1 : NO_THREAD;
+	}
+	osFreeHead = 0;
+	osStackArenaInit();
 	
 	//initialize the idle thread's period, which is always RR timeout
 	osThreads[MAX_THREADS].period = RR_TIMEOUT;
+	
+	//nothing is ready yet
+	schedInit();
+}
+
+/*
+	Criticality mode. Starts low, goes high on the first high criticality overrun, and comes back down when the CPU goes idle.
+*/
+uint32_t osCritMode = CRIT_LO;
+uint32_t osCritSwitches = 0; //how many times we have gone into high mode
+
+/*
+	The deadline a job is scheduled by, relative to its release. That is the period, except for a CRIT_HI thread in low
+	mode, which goes by its virtual deadline. It is only what EDF sorts by: misses are still checked at the real deadline.
+*/
+static uint32_t relativeDeadline(int id)
+{
+	if(osCritMode == CRIT_LO && osThreads[id].criticality == CRIT_HI)
+		return osThreads[id].virtualDeadline;
+	return osThreads[id].period;
+}
+
+/*
+	Starts a new job for a timed thread. The job is released on the current tick and, since our
+	deadlines are implicit, has to be done one period later (or by its virtual deadline, see relativeDeadline).
+*/
+void osJobRelease(int id)
+{
+	osThreads[id].release = osTickCount;
+	osThreads[id].deadline = osThreads[id].release + relativeDeadline(id);
+	osThreads[id].execTicks = 0;
+	osThreads[id].jobStarted = false;
+}
+
+/*
+	A timed thread's deadline went by while its job was still ACTIVE. The job that should be released now moves its release and
+	deadline one period on, and the thread's miss policy decides whether the late job keeps going or is replaced by a fresh one.
+	Returns true if the thread's stack was reset, which matters if it is the one SysTick interrupted.
+*/
+static bool deadlineMissed(int id)
+{
+	osThreads[id].missCount++;
+	
+	bool aborted = false;
+	if(osThreads[id].missPolicy == MISS_CALLBACK)
+		osThreads[id].missHandler(id);
+	else if(osThreads[id].missPolicy == MISS_ABORT)
+	{
+		osThreadStackInit(id);
+		aborted = true;
+	}
+	
+	//the release that's due now keeps the grid either way. Taking it out and putting it back moves it in the heap
+	schedOnBlock(id);
+	osThreads[id].release += osThreads[id].period;
+	osThreads[id].deadline = osThreads[id].release + relativeDeadline(id);
+	if(aborted)
+	{
+		//a late job that carries on keeps counting towards its own WCET. An aborted one is replaced by a new job, which
+		//hasn't started as far as SRP is concerned, so it has to get past the ceiling like any other
+		osThreads[id].execTicks = 0;
+		osThreads[id].jobStarted = false;
+	}
+	schedOnWake(id);
+	
+	return aborted;
+}
+
+/*
+	Arms a thread's timeout. We walk down the list using up the deltas of the threads in front of us until
+	we find the first one that expires later than we do, and slot in before it. Threads that expire on the same tick stay
+	in the order they were added. This is the only part of the timer list that isn't O(1), and it runs when a thread
+	sleeps or yields rather than on every tick.
+
+	The soonest anything can expire is the next tick, so a timeout of 0 is armed as 1. A delta of 0 is only ever for the threads
+	behind another one that expires on the same tick. If the head got one, the tick it is waiting for would go by without
+	counting it down, and everything behind it would expire a tick late.
+*/
+void osTimerInsert(int id, uint32_t ticks)
+{
+	if(ticks == 0)
+		ticks = 1;
+	
+	int prev = NO_THREAD;
+	int next = osTimerHead;
+	
+	while(next != NO_THREAD && osThreads[next].timerDelta <= ticks)
+	{
+		ticks -= osThreads[next].timerDelta;
+		prev = next;
+		next = osThreads[next].timerNext;
+	}
+	
+	osThreads[id].timerDelta = ticks;
+	osThreads[id].timerPrev = prev;
+	osThreads[id].timerNext = next;
+	
+	//whoever is behind us now expires relative to us instead
+	if(next != NO_THREAD)
+	{
+		osThreads[next].timerDelta -= ticks;
+		osThreads[next].timerPrev = id;
+	}
+	
+	if(prev == NO_THREAD)
+		osTimerHead = id;
+	else
+		osThreads[prev].timerNext = id;
+}
+
+/*
+	Disarms a thread's timeout. Our delta gets handed to the thread behind us so that it still expires on the same tick.
+*/
+void osTimerRemove(int id)
+{
+	//not in the list at all
+	if(osThreads[id].timerPrev == NO_THREAD && osTimerHead != id)
+		return;
+	
+	int prev = osThreads[id].timerPrev;
+	int next = osThreads[id].timerNext;
+	
+	if(next != NO_THREAD)
+	{
+		osThreads[next].timerDelta += osThreads[id].timerDelta;
+		osThreads[next].timerPrev = prev;
+	}
+	
+	if(prev == NO_THREAD)
+		osTimerHead = next;
+	else
+		osThreads[prev].timerNext = next;
+	
+	osThreads[id].timerNext = NO_THREAD;
+	osThreads[id].timerPrev = NO_THREAD;
 }
 
 /*
@@ -83,46 +276,313 @@ void setThreadingWithPSP(uint32_t* threadStack)
 */
 void osThreadSleep(uint32_t sleepTicks)
 {
-	osThreads[osCurrentTask].timeout = sleepTicks;
-	osThreads[osCurrentTask].status = WAITING;
-	__ASM("SVC #1");
+	//the status is changed inside the system call, since that is also where the thread leaves its ready queue
+	osSvcCall(sleepTicks, 0, 0, 0, SLEEP_SWITCH);
+}
+
+/*
+	Sleeps the current thread until the start of its next period. Unlike osThreadSleep(period), the wakeup is
+	worked out from when this job was released rather than from now, so however long the job body takes, the
+	releases stay exactly one period apart and never drift. If the job ran past its next release, the next job
+	starts straight away. Servers don't have periods like that, so for them this does nothing.
+*/
+void osWaitForNextPeriod(void)
+{
+	osSvcCall(0, 0, 0, 0, WAIT_PERIOD_SWITCH);
+}
+
+/*
+	Sleeps the current thread until the tick count reaches wakeTick. Loops that work out their own
+	release times can use this without the drift that comes from sleeping relative to now.
+*/
+bool osThreadSleepUntil(uint32_t wakeTick)
+{
+	return osSvcCall(wakeTick, 0, 0, 0, SLEEP_UNTIL_SWITCH) != 0;
+}
+
+/*
+	Charges a tick to a thread with a CPU budget. Top ups happen on a fixed grid of budgetPeriod ticks. A thread that is
+	running or ready when one comes around just gets topped up the next time it's charged, which is the only time anyone
+	looks, and any periods it skipped are skipped for good: unused budget doesn't pile up. When the budget runs out the thread
+	is THROTTLED and its timeout is armed for the next top up. Returns true if that happened.
+*/
+static bool chargeBudget(int id)
+{
+	if(!TIME_BEFORE(osTickCount, osThreads[id].budgetRelease))
+	{
+		uint32_t late = osTickCount - osThreads[id].budgetRelease;
+		osThreads[id].budgetRelease += (late / osThreads[id].budgetPeriod + 1) * osThreads[id].budgetPeriod;
+		osThreads[id].budgetLeft = osThreads[id].budget;
+	}
+	
+	osThreads[id].budgetLeft--;
+	if(osThreads[id].budgetLeft > 0)
+		return false;
+	
+	schedOnBlock(id);
+	osThreads[id].status = THROTTLED;
+	osTimerInsert(id, osThreads[id].budgetRelease - osTickCount);
+	return true;
+}
+
+/*
+	Charges a tick to a server thread. A server that runs out of budget stays runnable, but its budget is refilled and its
+	deadline moves back a period, so it drops behind anything that is more urgent now. Returns true if it was rekeyed.
+*/
+static bool chargeServer(int id)
+{
+	osThreads[id].budgetLeft--;
+	if(osThreads[id].budgetLeft > 0)
+		return false;
+	
+	schedOnBlock(id);
+	osThreads[id].budgetLeft = osThreads[id].budget;
+	osThreads[id].deadline += osThreads[id].period;
+	schedOnWake(id);
+	return true;
+}
+
+/*
+	A server thread woke up with work to do. If it can finish what's left of its budget before its current deadline without
+	going over its share of the CPU, it keeps both. Otherwise it would be getting more than budget/period, so it gets a
+	fresh budget and a deadline one period from now. This is the rule that stops a server from saving up urgency while it sleeps.
+*/
+static void serverWake(int id)
+{
+	osThreads[id].release = osTickCount;
+	uint32_t timeLeft = osThreads[id].deadline - osTickCount;
+	if(!TIME_BEFORE(osTickCount, osThreads[id].deadline) || (uint64_t)osThreads[id].budgetLeft * osThreads[id].period >= (uint64_t)timeLeft * osThreads[id].budget)
+	{
+		osThreads[id].budgetLeft = osThreads[id].budget;
+		osThreads[id].deadline = osTickCount + osThreads[id].period;
+	}
+}
+
+/*
+	A CRIT_HI job went over its optimistic WCET, so we can't count on anyone keeping to theirs any more. High threads go back
+	to their real deadlines, which admission control made sure they can all still make with their pessimistic WCETs, and the
+	low threads are suspended, or slowed down if OS_CRIT_LO_PERIOD_SCALE says they should be.
+*/
+static void criticalitySwitch(void)
+{
+	osCritMode = CRIT_HI;
+	osCritSwitches++;
+	for(int i = 0; i < threadNums; i++)
+	{
+		if(osThreads[i].threadType != TIMED_THREAD || THREAD_DONE(osThreads[i].status))
+			continue;
+		
+		if(osThreads[i].criticality == CRIT_HI)
+		{
+			if(osThreads[i].status == ACTIVE)
+				schedOnBlock(i);
+			osThreads[i].deadline = osThreads[i].release + osThreads[i].period;
+			if(osThreads[i].status == ACTIVE)
+				schedOnWake(i);
+		}
+		else
+		{
+#if OS_CRIT_LO_PERIOD_SCALE == 0
+			//a suspended thread has nothing to time out. Whatever it was doing is picked up again as its next job
+			if(osThreads[i].status == ACTIVE)
+				schedOnBlock(i);
+			osTimerRemove(i);
+			osThreads[i].status = SUSPENDED;
+#else
+			//the job it's on keeps its deadline, and the longer period starts from its next release
+			osThreads[i].period *= OS_CRIT_LO_PERIOD_SCALE;
+#endif
+		}
+	}
+}
+
+/*
+	Nothing is ready, so there are no high jobs left that could still need their pessimistic WCETs. It's safe to go back to
+	low mode: the low threads come back with a job released now, and the high ones get virtual deadlines from their next release.
+*/
+static void criticalityReset(void)
+{
+	osCritMode = CRIT_LO;
+	for(int i = 0; i < threadNums; i++)
+	{
+		if(osThreads[i].threadType != TIMED_THREAD || osThreads[i].criticality == CRIT_HI || THREAD_DONE(osThreads[i].status))
+			continue;
+#if OS_CRIT_LO_PERIOD_SCALE == 0
+		if(osThreads[i].status == SUSPENDED)
+		{
+			osJobRelease(i);
+			osThreads[i].status = ACTIVE;
+			schedOnWake(i);
+			osThreads[i].timeout = osThreads[i].period;
+			osTimerInsert(i, osThreads[i].period);
+		}
+#else
+		osThreads[i].period /= OS_CRIT_LO_PERIOD_SCALE;
+#endif
+	}
+}
+
+/*
+	Asks PendSV to switch to whoever the scheduler just picked. Quite often that is the thread that was already running, like
+	an RR thread whose quantum ran out with nobody else on its level, and then there is nothing to do: we go straight back
+	to it from the trap without saving or restoring anything.
+*/
+static void pendSwitch(void)
+{
+	if(osNextTCB == osCurrentTCB)
+	{
+		osSwitchStats.sameThread++;
+		//an earlier pick may have asked for a switch that PendSV hasn't got to yet. ICSR's set and clear bits are write-only
+		//triggers, so this is a plain write rather than |=, which could hit both
+		_ICSR = 1<<27;
+		return;
+	}
+	_ICSR |= 1<<28;
+	__asm("isb");
+}
+
+/*
+	A thread with a preemption threshold can only be preempted by a thread whose priority is above the threshold, so work
+	that is more urgent than it but not urgent enough waits until it yields, sleeps or exits, the same as ThreadX. Running out
+	of quantum only hands over the CPU when another thread shares its level, so a thread that is alone on its level and never
+	gives up the CPU holds that work back for good. Priorities are the
+	one measure of urgency every policy has (timed threads get rate-monotonic ones, which is the same order as their
+	deadlines' lengths), so this works the same way under all of them. Returns true if the switch should go ahead.
+*/
+static bool thresholdAllowsPreemption(void)
+{
+	if(osCurrentTask < 0 || osCurrentTask >= MAX_THREADS || osThreads[osCurrentTask].status != ACTIVE || osThreads[osCurrentTask].preemptThreshold == 0)
+		return true;
+	
+	int next = schedPickNext();
+	if(next == osCurrentTask || next == MAX_THREADS || osThreads[next].priority > osThreads[osCurrentTask].preemptThreshold)
+		return true;
+	
+	osSwitchStats.preemptionsAvoided++;
+	return false;
 }
 
 void SysTick_Handler(void)
 {
-		//First, reduce all timeouts no matter what. If any threads' timeouts are zero, 
-		//move them to ACTIVE. If that happens, we have to do a context switch
+		osTickCount++;
+		
 		bool contextSwitch = false;
-		for(int i = 0; i < threadNums; i++)
+		bool currentAborted = false;
+		bool woke = false; //a thread became ready, which can only take over if it's allowed to preempt
+		
+		//The thread we interrupted gets charged for this tick. Going over its declared WCET counts once per job,
+		//and running out of CPU budget takes it off the CPU until the budget comes back
+		if(osCurrentTask >= 0 && osCurrentTask < MAX_THREADS)
 		{
-			osThreads[i].timeout--;
-			if(osThreads[i].timeout == 0 && osThreads[i].status == WAITING)
+			osThreads[osCurrentTask].execTicks++;
+			if(osThreads[osCurrentTask].threadType == TIMED_THREAD && osThreads[osCurrentTask].execTicks == osThreads[osCurrentTask].wcet + 1)
 			{
-				osThreads[i].timeout = osThreads[i].period;
-				osThreads[i].status = ACTIVE;
-				contextSwitch = true;
+				osThreads[osCurrentTask].overrunCount++;
+				//in low mode, a high criticality overrun is what sends us to high mode
+				if(osThreads[osCurrentTask].criticality == CRIT_HI && osCritMode == CRIT_LO)
+				{
+					criticalitySwitch();
+					contextSwitch = true;
+				}
 			}
-			else if(osThreads[i].timeout == 0 && osThreads[i].status == ACTIVE)
+			if(osThreads[osCurrentTask].status == ACTIVE && osThreads[osCurrentTask].budget != 0)
 			{
-				//needed in case a task is running continuously and never yields
-				osThreads[i].timeout = osThreads[i].period;
-				osThreads[i].status = WAITING;
-				contextSwitch = true;
+				if(osThreads[osCurrentTask].threadType == SERVER_THREAD ? chargeServer(osCurrentTask) : chargeBudget(osCurrentTask))
+					contextSwitch = true;
 			}
 		}
 		
+		//Only the head of the timer list has to count down. When it hits zero it expires, and so does everything
+		//behind it with a delta of zero, since those were due on the same tick. A WAITING thread wakes up. An ACTIVE
+		//thread can only be a timed thread whose deadline just went by, and its miss policy deals with it. A THROTTLED
+		//thread gets its budget back and carries on where it left off.
+		if(osTimerHead != NO_THREAD)
+		{
+			//tickless idle can count the head's last tick itself when that boundary goes by with the counter stopped, and then
+			//the head is already due on this tick
+			if(osThreads[osTimerHead].timerDelta > 0)
+				osThreads[osTimerHead].timerDelta--;
+			while(osTimerHead != NO_THREAD && osThreads[osTimerHead].timerDelta == 0)
+			{
+				int i = osTimerHead;
+				osTimerRemove(i);
+				
+				if(osThreads[i].status == WAITING)
+				{
+					//waking up is the start of the thread's next job, which needs a fresh deadline before it goes in the heap.
+					//A server decides for itself whether it needs one
+					if(osThreads[i].threadType == SERVER_THREAD)
+						serverWake(i);
+					else
+						osJobRelease(i);
+					osThreads[i].status = ACTIVE;
+					schedOnWake(i);
+					woke = true;
+				}
+				else if(osThreads[i].status == ACTIVE)
+				{
+					if(deadlineMissed(i) && &osThreads[i] == osCurrentTCB)
+						currentAborted = true;
+					contextSwitch = true;
+				}
+				else if(osThreads[i].status == THROTTLED)
+				{
+					osThreads[i].budgetLeft = osThreads[i].budget;
+					osThreads[i].budgetRelease += osThreads[i].budgetPeriod;
+					osThreads[i].status = ACTIVE;
+					schedOnWake(i);
+					woke = true;
+				}
+				
+				//timed threads always have a timeout armed: their deadline while ACTIVE, their next release while WAITING.
+				//RR threads only had one because they were asleep, and now they're awake. The cyclic executive's table does
+				//all of this for timed threads instead
+				if(osThreads[i].threadType == TIMED_THREAD && OS_SCHED_POLICY != SCHED_TABLE)
+				{
+					osThreads[i].timeout = osThreads[i].period;
+					osTimerInsert(i, osThreads[i].period);
+				}
+			}
+		}
+		
+#if OS_PARTITIONS > 1
+		//A new window can give the CPU to a different partition, whatever is running now
+		if(osPartitionStep())
+			contextSwitch = true;
+#endif
+		
+#if OS_SCHED_POLICY == SCHED_TABLE
+		//The cyclic executive steps through its table on every tick, including the ones the idle task gets
+		if(osSchedTableStep())
+			contextSwitch = true;
+#endif
+		
+		//Whatever per-tick accounting the policy does for the running thread, like using up its RR quantum
+		if(osCurrentTask >= 0 && osCurrentTask < MAX_THREADS && osThreads[osCurrentTask].status == ACTIVE)
+		{
+			if(schedOnTick(osCurrentTask))
+				contextSwitch = true;
+		}
+		
+		//Anything else that changed makes us reschedule no matter what, but a wakeup on its own has to get past the threshold
+		if(woke && !contextSwitch && thresholdAllowsPreemption())
+			contextSwitch = true;
+		
 		//Now if we need to foce a context switch, we do it
 		if(contextSwitch)
 		{
-			//Save the stack, with an offset. Remember that we are already in an interrupt so the 8 hardware-stored registers are already on the stack
-			osThreads[osCurrentTask].taskStack = (uint32_t*)(__get_PSP() - 8*4); //we are about to push a bunch of things
+			//PendSV saves the stack of whoever is running. An aborted job's stack was just rebuilt from scratch, so there is nothing worth saving
+			if(currentAborted)
+				osCurrentTCB = NULL;
 			
-			//Run the scheduler.
+			//Run the scheduler. If whoever was running could have kept going, that was a preemption
+			int previous = osCurrentTask;
 			scheduler();
+			if(osCurrentTask != previous && previous >= 0 && previous < MAX_THREADS && osThreads[previous].status == ACTIVE)
+				osSwitchStats.preemptions++;
 			
-			//Pend an interrupt to do the context switch
-			_ICSR |= 1<<28;
-			__asm("isb");
+			//Pend an interrupt to do the context switch, unless it's back to the same thread
+			pendSwitch();
 		}
 	
 	//We may now return. Note that with the system-call framework yield can no longer block sysTick, but sysTick
@@ -130,32 +590,59 @@ void SysTick_Handler(void)
 	return;
 }
 
+/*
+	A handler other than SysTick made a thread ready, like by creating one. SysTick only reschedules when something it looks
+	after changes, and the idle task can sleep through any number of ticks, so the handler has to do it itself. It counts as a
+	wakeup, so it has to get past the running thread's threshold. Interrupts have to be off, since SysTick picks too.
+*/
+void osHandlerReschedule(void)
+{
+	if(!thresholdAllowsPreemption())
+		return;
+	int previous = osCurrentTask;
+	scheduler();
+	if(osCurrentTask != previous && previous >= 0 && previous < MAX_THREADS && osThreads[previous].status == ACTIVE)
+		osSwitchStats.preemptions++;
+	pendSwitch();
+}
+
 /*
 	The scheduler. When a new thread is ready to run, this function
-	decides which one goes. This is a round-robin scheduler for now.
+	decides which one goes.
+
+	The decision itself belongs to the policy picked in osDefs.h (see _schedCore.c). Every policy keeps its ready threads
+	in the ready bitmap and/or the deadline heap, so the pick doesn't depend on how many threads there are.
 */
 void scheduler(void)
 {
-	
-	bool isFound = false;
-	uint32_t earliestDeadline = WORST_CASE_DEADLINE;
-	//we are idle, so let's search the array starting at 0
-	for(int i = 0; i < threadNums; i++)
+	int next = schedPickNext();
+	//the CPU going idle is when high mode ends, and the low threads that come back may want to run straight away
+	if(next == MAX_THREADS && osCritMode == CRIT_HI)
 	{
-		if(osThreads[i].timeout != 0 && osThreads[i].status == ACTIVE && earliestDeadline > osThreads[i].timeout) //we've found one
-		{
-			isFound = true;
-			earliestDeadline = osThreads[i].timeout;
-			osCurrentTask = i;
-		}
+		criticalityReset();
+		next = schedPickNext();
 	}
-	
-	//if we haven't found anything, that means that nothing is ready to run, so we run the idle task
-	if(!isFound)
+	if(next != osCurrentTask)
+		osSwitchStats.switches++;
+#if OS_SRP
+	//a shared-stack job that is starting gets its first frame on top of the shared stack, under the job it is preempting.
+	//If that job is the one running, PendSV hasn't saved its stack pointer yet, but we know it will be 8 registers below PSP
+	if(next < MAX_THREADS && !osThreads[next].jobStarted && osThreads[next].sharedStack)
 	{
-		osCurrentTask = MAX_THREADS;
+		uint32_t* top = (uint32_t*)&osSharedStack[OS_SHARED_STACK_SIZE / 8];
+		if(osSharedTop != NO_THREAD && &osThreads[osSharedTop] == osCurrentTCB)
+			top = (uint32_t*)(__get_PSP() - 8*4);
+		else if(osSharedTop != NO_THREAD)
+			top = osThreads[osSharedTop].taskStack;
+		osThreads[next].sharedBelow = osSharedTop;
+		osSharedTop = next;
+		osThreadStackInitAt(next, top);
 	}
-	
+	if(next < MAX_THREADS)
+		osThreads[next].jobStarted = true;
+#endif
+	osCurrentTask = next;
+	osNextTCB = &osThreads[next];
 }
 
 /*
@@ -176,62 +663,387 @@ void scheduler(void)
 void osYield(void)
 {
 	//Trigger the SVC right away and let our system call framework handle it.
-	__ASM("SVC #0");
+	osSvcCall(0, 0, 0, 0, YIELD_SWITCH);
+}
+
+/*
+	A shared-stack job's function returned. There's no way to go back into it, so this ends the job with a system call and
+	the job's frame is simply dropped off the shared stack.
+*/
+void osJobReturn(void)
+{
+	osSvcCall(0, 0, 0, 0, JOB_DONE_SWITCH);
+	while(1); //never gets here
+}
+
+/*
+	Every thread but a shared-stack job comes here when its function returns, since that is what its LR was set to. Before
+	this the LR was 0xE and returning was a hard fault.
+*/
+void osThreadReturn(void)
+{
+	osThreadExit(0);
+	while(1); //never gets here
+}
+
+/*
+	Ends the running thread. exitCode goes to whoever joins it. The stack and the slot are given back once nobody needs them,
+	which is right away for a detached thread.
+*/
+void osThreadExit(uint32_t exitCode)
+{
+	osSvcCall(exitCode, 0, 0, 0, THREAD_EXIT_SWITCH);
+}
+
+/*
+	Waits for thread "id" to exit and puts its exit code in *exitCode, which may be NULL. The thread's slot is freed after.
+	Returns false straight away for a thread that doesn't exist, is detached, is already being joined, or is joining us.
+	Only RR threads can wait: a timed thread can only collect a thread that has already exited.
+*/
+bool osThreadJoin(int id, uint32_t* exitCode)
+{
+	return osSvcCall((uint32_t)id, (uint32_t)exitCode, 0, 0, THREAD_JOIN_SWITCH) != 0;
+}
+
+//goes on the free list's head, so the slot that was freed last is the next one used
+void osThreadSlotFree(int id)
+{
+	//the slot's stack is only its own while the slot is in use, so that a new thread here can have a different size
+	if(osThreads[id].stackBase != NULL)
+		osStackFree(osThreads[id].stackBase, osThreads[id].stackSize);
+	osThreads[id].stackBase = NULL;
+	osThreads[id].stackSize = 0;
+	osThreads[id].status = DESTROYED;
+	osThreads[id].period = UNITIALIZED_THREAD_PERIOD; //so that osThreadNew doesn't think the next thread here is timed
+#if OS_SCHED_POLICY == SCHED_TABLE
+	//the table still has frames for a timed thread, which would go to whoever got its slot next. It stays empty instead
+	if(osThreads[id].threadType == TIMED_THREAD)
+		return;
+#endif
+	osThreads[id].next = osFreeHead;
+	osFreeHead = id;
+}
+
+/*
+	Puts the running thread to sleep for "ticks" ticks. This is what every blocking system call
+	boils down to: off the ready structure, WAITING, and a timeout armed for when it should wake up.
+*/
+static void blockCurrentThread(uint32_t ticks)
+{
+	//SysTick may have already taken us off the ready queue if our timeout ran out just before the call
+	if(osThreads[osCurrentTask].status == ACTIVE)
+		schedOnBlock(osCurrentTask);
+	osThreads[osCurrentTask].status = WAITING;
+	osTimerRemove(osCurrentTask);
+	osTimerInsert(osCurrentTask, ticks);
+}
+
+/*
+	The running timed thread's job is done, so it waits for its next release. The next release is on the grid set by the last
+	one, not relative to now, so the time the job body took doesn't matter.
+*/
+static void waitForNextRelease(void)
+{
+	uint32_t nextRelease = osThreads[osCurrentTask].release + osThreads[osCurrentTask].period;
+	if(TIME_BEFORE(osTickCount, nextRelease))
+	{
+		blockCurrentThread(nextRelease - osTickCount);
+	}
+	else
+	{
+		//The job overran into its next period, so that job is already due. It starts right away and keeps the grid,
+		//which means its deadline (and the timeout that goes with it) has to move back by a period
+		//It's a new job, so it starts with no ticks used, and SRP holds it back until it's above the ceiling like any other
+		schedOnBlock(osCurrentTask);
+		osThreads[osCurrentTask].release = nextRelease;
+		osThreads[osCurrentTask].deadline = nextRelease + relativeDeadline(osCurrentTask);
+		osThreads[osCurrentTask].execTicks = 0;
+		osThreads[osCurrentTask].jobStarted = false;
+		schedOnWake(osCurrentTask);
+		
+		//only a timed thread has a deadline that can go by. An RR thread just carries on with its new release
+		if(osThreads[osCurrentTask].threadType == TIMED_THREAD)
+		{
+			osTimerRemove(osCurrentTask);
+			osTimerInsert(osCurrentTask, osThreads[osCurrentTask].deadline - osTickCount);
+		}
+	}
+}
+
+/*
+	The system calls. Each one gets the caller's stacked registers, with its arguments in args[0] to args[3] (r0 to r3 when
+	it called osSvcCall), and anything it returns goes in args[0], which is what the caller finds in r0 when it gets going
+	again. They return SVC_RETURN, SVC_SWITCH or SVC_SWITCH_NO_SAVE to tell the dispatcher what to do next.
+*/
+static uint32_t svcYield(uint32_t* args)
+{
+	//An RR thread that yields just goes to the back of its queue and never stops being runnable. For a timed thread yield
+	//means the job is done, so it has to set the timeout too so that we can re-run the task next period
+	if(!schedOnYield(osCurrentTask))
+	{
+		osThreads[osCurrentTask].timeout = osThreads[osCurrentTask].period;
+		blockCurrentThread(osThreads[osCurrentTask].timeout);
+	}
+	return SVC_SWITCH;
+}
+
+//args[0] is how many ticks to sleep for
+static uint32_t svcSleep(uint32_t* args)
+{
+	osThreads[osCurrentTask].timeout = args[0];
+	blockCurrentThread(args[0]);
+	return SVC_SWITCH;
+}
+
+static uint32_t svcWaitPeriod(uint32_t* args)
+{
+	//a server's deadline belongs to its budget, so it has no period to wait out. It should sleep instead
+	if(osThreads[osCurrentTask].threadType == SERVER_THREAD)
+		return SVC_RETURN;
+#if OS_SCHED_POLICY == SCHED_TABLE
+	//the table releases the next job on its own, so all we do is finish this one
+	schedOnYield(osCurrentTask);
+#else
+	waitForNextRelease();
+#endif
+	return SVC_SWITCH;
+}
+
+//args[0] is the tick to wake up at. Returns whether we slept, since if it has already come there's nothing to wait for
+static uint32_t svcSleepUntil(uint32_t* args)
+{
+	if(!TIME_BEFORE(osTickCount, args[0]))
+	{
+		args[0] = false;
+		return SVC_RETURN;
+	}
+	blockCurrentThread(args[0] - osTickCount);
+	args[0] = true;
+	return SVC_SWITCH;
+}
+
+//nothing changes for the caller. Something it was holding back may get to go now
+static uint32_t svcReschedule(uint32_t* args)
+{
+	return SVC_SWITCH;
+}
+
+static uint32_t svcJobDone(uint32_t* args)
+{
+#if OS_SRP
+	//the job's frame comes off the shared stack, and the next job starts with a fresh one
+	osSharedTop = osThreads[osCurrentTask].sharedBelow;
+	osThreads[osCurrentTask].jobStarted = false;
+	waitForNextRelease();
+	return SVC_SWITCH_NO_SAVE;
+#else
+	return SVC_RETURN;
+#endif
+}
+
+//down with the rest of the mutex code
+static void mutexReleaseAll(int id);
+
+/*
+	args[0] is the exit code. The caller comes off everything it was on and wakes up its joiner if it has one. If nobody is
+	going to join it the slot is freed now, and otherwise it is EXITED until they do. Its stack is never used again.
+*/
+static uint32_t svcThreadExit(uint32_t* args)
+{
+	int id = osCurrentTask;
+	if(osThreads[id].status == ACTIVE)
+		schedOnBlock(id);
+	osTimerRemove(id);
+	osThreads[id].status = EXITED;
+	osThreads[id].exitCode = args[0];
+	osNumThreadsRunning--;
+	
+	//whatever it held would be stuck with an id that's gone, and the next thread to get the slot would find itself holding it
+	mutexReleaseAll(id);
+#if OS_SRP
+	//SRP makes sure a shared-stack job is on top of the shared stack while it runs, so its frame just comes off
+	if(osThreads[id].sharedStack)
+	{
+		osSharedTop = osThreads[id].sharedBelow;
+		osThreads[id].jobStarted = false;
+	}
+#endif
+	
+	//the CPU it was using is free, and elastic threads that were stretched to fit can have it back
+	if(osThreads[id].threadType != RR_THREAD && OS_SCHED_POLICY != SCHED_TABLE && schedAdmitElastic(NO_THREAD))
+		osTaskSetSchedulable = true;
+	
+	int joiner = osThreads[id].joiner;
+	if(joiner != NO_THREAD)
+	{
+		if(osThreads[joiner].joinResult != NULL)
+			*osThreads[joiner].joinResult = args[0];
+		osJobRelease(joiner);
+		osThreads[joiner].status = ACTIVE;
+		schedOnWake(joiner);
+	}
+	if(joiner != NO_THREAD || osThreads[id].detached)
+		osThreadSlotFree(id);
+	return SVC_SWITCH_NO_SAVE;
+}
+
+//args[0] is the thread to join and args[1] is where its exit code goes. Returns whether we got it
+static uint32_t svcThreadJoin(uint32_t* args)
+{
+	int id = (int)args[0];
+	uint32_t* result = (uint32_t*)args[1];
+	args[0] = false;
+	if(id < 0 || id >= threadNums || id == osCurrentTask || osThreads[id].status == DESTROYED)
+		return SVC_RETURN;
+	//two threads joining each other would wait forever
+	if(osThreads[id].detached || osThreads[id].joiner != NO_THREAD || osThreads[osCurrentTask].joiner == id)
+		return SVC_RETURN;
+	
+	args[0] = true;
+	if(osThreads[id].status == EXITED)
+	{
+		if(result != NULL)
+			*result = osThreads[id].exitCode;
+		osThreadSlotFree(id);
+		return SVC_RETURN;
+	}
+	
+	//a timed thread's timeout is its deadline, which would wake it up part way through the wait
+	if(osThreads[osCurrentTask].threadType != RR_THREAD)
+	{
+		args[0] = false;
+		return SVC_RETURN;
+	}
+	
+	//like sleeping, but with no timeout: the thread we're joining wakes us up when it exits
+	if(osThreads[osCurrentTask].status == ACTIVE)
+		schedOnBlock(osCurrentTask);
+	osThreads[osCurrentTask].status = WAITING;
+	osTimerRemove(osCurrentTask);
+	osThreads[osCurrentTask].joinResult = result;
+	osThreads[id].joiner = osCurrentTask;
+	return SVC_SWITCH;
+}
+
+static uint32_t svcTickCount(uint32_t* args)
+{
+	args[0] = osTickCount;
+	return SVC_RETURN;
+}
+
+//these are down with the rest of the mutex code
+static uint32_t svcMutexAcquire(uint32_t* args);
+static uint32_t svcMutexRelease(uint32_t* args);
+
+//indexed by system call number, see osDefs.h
+static uint32_t (*const osSvcTable[SVC_CALLS])(uint32_t* args) = {
+	svcYield, //YIELD_SWITCH
+	svcSleep, //SLEEP_SWITCH
+	svcWaitPeriod, //WAIT_PERIOD_SWITCH
+	svcSleepUntil, //SLEEP_UNTIL_SWITCH
+	svcReschedule, //RESCHEDULE_SWITCH
+	svcJobDone, //JOB_DONE_SWITCH
+	svcTickCount, //TICK_COUNT_CALL
+	svcMutexAcquire, //MUTEX_ACQUIRE_CALL
+	svcMutexRelease, //MUTEX_RELEASE_CALL
+	svcThreadExit, //THREAD_EXIT_SWITCH
+	svcThreadJoin //THREAD_JOIN_SWITCH
+};
+
+//true for the calls that always return SVC_RETURN. They never need the scheduler, so they can run without trapping
+static const bool osSvcInline[SVC_CALLS] = {
+	false, false, false, false, false, false, //everything that switches
+	true, //TICK_COUNT_CALL
+	true, //MUTEX_ACQUIRE_CALL
+	!OS_SRP, //MUTEX_RELEASE_CALL lowers the SRP ceiling, which can let a job in
+	false, false //THREAD_EXIT_SWITCH and THREAD_JOIN_SWITCH
+};
+
+/*
+	How the kernel API makes a system call. A call that never switches threads, made by code that is privileged already (a
+	handler, or a thread with nPRIV clear, which is every thread right now), doesn't need the SVC at all: all the exception
+	gets it is the caller's registers on a stack and nothing getting in between, and masking interrupts for the length of
+	the handler does the same thing for a lot less. Anything else traps. A handler has to run them inline no matter what,
+	since it can't take an SVC.
+*/
+uint32_t osKernelCall(uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t call)
+{
+	if(call < SVC_CALLS && osSvcInline[call] && (__get_IPSR() != 0 || (OS_FAST_CALLS && (__get_CONTROL() & 1) == 0)))
+	{
+		uint32_t args[4] = {a0, a1, a2, a3};
+		uint32_t primask = __get_PRIMASK(); //so that a handler that already had them off gets them back off
+		__disable_irq();
+		osSvcTable[call](args);
+		__set_PRIMASK(primask);
+		return args[0];
+	}
+	return osSvcCall(a0, a1, a2, a3, call);
 }
 
 /*
 	An Extensible System Call implementation. This function is called by SVC_Handler, therefore it is used in Handler mode,
 	not thread mode. This will almost certainly not be a big deal, but you should be aware of it in case you wanted to 
 	use thread-specific stuff. That is not possible without finding the stack.
+
+	svc_args is the caller's stacked r0, r1, r2, r3, r12, LR, PC and xPSR. osSvcCall put the call number in r12, so we don't have
+	to read the SVC instruction back out of memory any more, and the arguments come in registers instead of being written
+	into the thread's struct before the trap, where SysTick could get in between.
 */
 void SVC_Handler_Main(uint32_t *svc_args)
 {
+	uint32_t call = svc_args[4];
 	
-	//ARM sets up our stack frame a bit weirdly. The system call number is 2 characters behind the input argument
-	char call = ((char*)svc_args[6])[-2];
+	if(call >= SVC_CALLS)
+		return;
 	
-	//Now system calls are giant if statements (or switch/case statements, which are used when you have a lot of different types of
-	//system calls for efficiency reasons). At the moment we are only implementing a single system call, but it's good to ensure
-	//the functionality is there
-	if(call == YIELD_SWITCH)
+	//This curiosity enables us to start the first task: the very first yield comes from osKernelStart, which isn't a thread.
+	//Calls that don't switch are fine before then, though
+	if(osCurrentTask < 0 && !osSvcInline[call])
 	{
-		//Everything below was once part of the yield function, including this curiosity that enables us to start the first task
-		if(osCurrentTask >= 0)
-		{
-			osThreads[osCurrentTask].status = WAITING;	
-			osThreads[osCurrentTask].timeout = osThreads[osCurrentTask].period; //yield has to set this too so that we can re-run the task
-			
-			osThreads[osCurrentTask].taskStack = (uint32_t*)(__get_PSP() - 8*4); //we are about to push 8 uint32_ts
-		}
-		
-		//Run the scheduler
-			scheduler();
-		
-		//Pend a context switch
-			_ICSR |= 1<<28;
-			__asm("isb");
+		scheduler();
+		_ICSR |= 1<<28;
+		__asm("isb");
+		return;
 	}
-	else if(call == SLEEP_SWITCH)
+	
+#if OS_SRP
+	//A shared-stack job can't stop part way: the jobs above it on the stack have to finish first, and it has to finish before
+	//the ones under it. Anything that would make it wait just returns, and the job ends when its function does
+	if(osThreads[osCurrentTask].sharedStack && (call == YIELD_SWITCH || call == SLEEP_SWITCH || call == WAIT_PERIOD_SWITCH || call == SLEEP_UNTIL_SWITCH || call == THREAD_JOIN_SWITCH))
+		return;
+#endif
+	
+	uint32_t action = osSvcTable[call](svc_args);
+	if(action == SVC_RETURN)
+		return;
+	
+	//PendSV saves the caller's stack. A job that is done on the shared stack, or a thread that exited, is never coming back to it,
+	//so there is nothing worth saving
+	if(action == SVC_SWITCH_NO_SAVE)
+		osCurrentTCB = NULL;
+	
+	//Run the scheduler
+	scheduler();
+	
+	//Pend a context switch, unless it's back to the same thread
+	pendSwitch();
+}
+
+#if OS_SRP
+//a mutex's ceiling is the highest preemption level of any thread that says it uses it
+static void srpComputeCeilings(void)
+{
+	for(int m = 0; m < mutexNums; m++)
 	{
-		//Everything below was once part of the yield function, including this curiosity that enables us to start the first task
-		if(osCurrentTask >= 0)
+		osMutexes[m].ceiling = 0;
+		for(int i = 0; i < threadNums; i++)
 		{
-			osThreads[osCurrentTask].status = WAITING;	
-			
-			//almost identical to yield switch, but we don't set the period because sleep already did that
-			
-			//We've finally gotten away from the weird 17*4 offset! Since we are already in handler mode, the stack frame is aligned like we did for SysTick
-			osThreads[osCurrentTask].taskStack = (uint32_t*)(__get_PSP() - 8*4); //we are about to push a bunch of things
+			if(osThreads[i].mutexResources[m] && osThreads[i].preemptLevel > osMutexes[m].ceiling)
+				osMutexes[m].ceiling = osThreads[i].preemptLevel;
 		}
-		
-		//Run the scheduler
-			scheduler();
-		
-		//Pend a context switch
-			_ICSR |= 1<<28;
-			__asm("isb");
 	}
 }
+#endif
 
 /*
 	Starts the threads if threads have been created. Returns false otherwise. Note that it does
@@ -251,7 +1063,23 @@ bool osKernelStart()
 	//there is no point (it would just run the idle task), so we return
 	if(threadNums > 0)
 	{
+#if OS_PARTITIONS > 1
+		//with no windows, no partition would ever get to run
+		if(osPartitionWindowLeft() == 0)
+			return 0;
+#endif
+#if OS_SRP
+		//every thread has said which mutexes it uses by now, so the ceilings can't change any more
+		srpComputeCeilings();
+#endif
+#if OS_SCHED_POLICY == SCHED_TABLE
+		//the whole schedule for the timed threads is decided now. If it can't be, we don't start
+		if(!osSchedBuildTable())
+			return 0;
+#endif
 		osCurrentTask = -1;
+		osCurrentTCB = NULL; //the first switch has nothing to save
+		osKernelRunning = true;
 		__set_CONTROL(1<<1);
 		//run the idle task first, since we are sure it exists
 		__set_PSP((uint32_t)osThreads[MAX_THREADS].taskStack);
@@ -276,17 +1104,229 @@ void osIdleTask(void*args)
 	while(1)
 	{
 	 //does nothing. The timer interrupt handles this part
+#if OS_TICKLESS_IDLE && OS_SCHED_POLICY != SCHED_TABLE
+		osTicklessSleep(); //the cyclic executive needs every tick to step its table
+#endif
 	}
 }
 
+/*
+	Copies out the context switch counters. Interrupts are off while we copy so that they all come from the same moment.
+*/
+void osGetSwitchStats(switchStats* stats)
+{
+	__disable_irq();
+	*stats = osSwitchStats;
+	__enable_irq();
+}
+
+void osResetSwitchStats(void)
+{
+	__disable_irq();
+	osSwitchStats.switches = 0;
+	osSwitchStats.preemptions = 0;
+	osSwitchStats.preemptionsAvoided = 0;
+	osSwitchStats.sameThread = 0;
+	__enable_irq();
+}
+
+uint32_t osCriticalityMode(void)
+{
+	return osCritMode;
+}
+
+uint32_t osCriticalitySwitchCount(void)
+{
+	return osCritSwitches;
+}
+
+/*
+	Returns the number of SysTick ticks since the kernel started.
+*/
+uint32_t osKernelGetTickCount(void)
+{
+	return osKernelCall(0, 0, 0, 0, TICK_COUNT_CALL);
+}
+
+#if OS_TICKLESS_IDLE
+/*
+	The idle task only runs when no thread is ACTIVE, so the next thing that can happen is the head
+	of the timer list expiring, and its delta is exactly how long that is.
+*/
+static uint32_t ticksUntilNextWakeup(void)
+{
+	uint32_t ticks = WORST_CASE_DEADLINE;
+	if(osTimerHead != NO_THREAD)
+		ticks = osThreads[osTimerHead].timerDelta;
+#if OS_PARTITIONS > 1
+	//the end of a window can wake up some other partition's threads, so it counts as a wakeup too
+	if(osPartitionWindowLeft() < ticks)
+		ticks = osPartitionWindowLeft();
+#endif
+	return ticks;
+}
+
+/*
+	Adds ticks that went by without a SysTick interrupt. This is only ever less than the earliest
+	wakeup, so nothing can expire in here and the normal SysTick_Handler still does all of the state changes.
+	Since the timer list is delta-encoded only the head needs to move.
+*/
+static void catchUpTicks(uint32_t ticks)
+{
+	osTickCount += ticks;
+	if(osTimerHead != NO_THREAD)
+		osThreads[osTimerHead].timerDelta -= ticks;
+#if OS_PARTITIONS > 1
+	osPartitionSkipTicks(ticks);
+#endif
+}
+
+/*
+	Puts the CPU to sleep until the next thread has to wake up. This is only called from the idle task.
+
+	SysTick is a 24-bit down counter, so we stop it, load it with however many cycles are left in the current tick plus
+	enough whole ticks to reach the next wakeup, and WFI. Interrupts stay masked with PRIMASK the whole time: WFI still wakes up
+	on a pending interrupt, but no handler runs until we've worked out how long we actually slept and fixed the tick count.
+
+	There are two ways to wake up:
+		- The long count ran out. The SysTick interrupt is now pending and will count the last tick itself, so we catch up the rest.
+		- Some other interrupt woke us early. We count how many tick boundaries went by from what is left on the counter.
+	Either way SysTick is then restarted so that its next interrupt lands exactly where the old 1 ms grid said it would.
+
+	Two things keep the grid from sliding later on every sleep. A LOAD of N counts N+1 cycles (down to 0, then one more to
+	reload), so a count of N cycles is loaded as N-1. And the counter is stopped twice while we work things out, which
+	OS_TICKLESS_STOPPED_CYCLES makes up for each time. All the times below are in cycles from when the counter was first stopped.
+*/
+void osTicklessSleep(void)
+{
+	uint32_t cyclesPerTick = OS_TICK_FREQ;
+	uint32_t maxTicks = SysTick_LOAD_RELOAD_Msk / cyclesPerTick;
+	
+	__disable_irq();
+	
+	uint32_t idleTicks = ticksUntilNextWakeup();
+	
+	//a tick is already waiting to be handled, or we'd wake up almost right away. Just sleep until the next interrupt
+	if(idleTicks < OS_TICKLESS_MIN_TICKS || (_ICSR & SCB_ICSR_PENDSTSET_Msk))
+	{
+		__DSB();
+		__WFI();
+		__enable_irq();
+		return;
+	}
+	
+	if(idleTicks > maxTicks)
+		idleTicks = maxTicks;
+	
+	//Stop the counter. We write CTRL rather than read-modify-write it so we don't throw away COUNTFLAG
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+	
+	//If the counter hit zero between the check above and stopping it, let that tick through normally
+	if(_ICSR & SCB_ICSR_PENDSTSET_Msk)
+	{
+		SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+		__enable_irq();
+		return;
+	}
+	
+	//The counter reaches zero on every tick boundary. What's left in VAL gets us to the next one, and then we add whole ticks.
+	//By the time the counter starts again it has been stopped for OS_TICKLESS_STOPPED_CYCLES of that
+	uint32_t remaining = SysTick->VAL;
+	uint32_t skippedTicks = 0;
+	if(remaining <= OS_TICKLESS_STOPPED_CYCLES)
+	{
+		//the boundary goes by while the counter is stopped, so it never interrupts. It's counted here and the whole ticks
+		//start from the one after it
+		remaining += cyclesPerTick;
+		idleTicks--;
+		skippedTicks = 1;
+	}
+	uint32_t reload = remaining + (idleTicks - 1) * cyclesPerTick - OS_TICKLESS_STOPPED_CYCLES - 1;
+	SysTick->LOAD = reload;
+	SysTick->VAL = 0; //writing anything clears the counter, so it restarts from LOAD
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	
+	__DSB();
+	__WFI();
+	__ISB();
+	
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+	uint32_t elapsedTicks;
+	uint32_t nextTickCycles;
+	if(_ICSR & SCB_ICSR_PENDSTSET_Msk)
+	{
+		//The whole sleep went by. The counter reloaded with the long value one cycle after it hit zero, so how far it has
+		//come down since then, plus that cycle, is how far into the new tick we are. Waking up takes nowhere near a whole
+		//tick, but the % keeps us on the grid even if it did
+		uint32_t sinceBoundary = (reload - SysTick->VAL + 1) % cyclesPerTick;
+		elapsedTicks = idleTicks - 1;
+		nextTickCycles = cyclesPerTick - sinceBoundary;
+	}
+	else
+	{
+		//Woken early. The counter took one cycle to load "reload" and was stopped for OS_TICKLESS_STOPPED_CYCLES before that.
+		//The first boundary was "remaining" cycles in, and then there is one every cyclesPerTick
+		uint32_t elapsedCycles = OS_TICKLESS_STOPPED_CYCLES + 1 + reload - SysTick->VAL;
+		elapsedTicks = 0;
+		if(elapsedCycles >= remaining)
+			elapsedTicks = 1 + (elapsedCycles - remaining) / cyclesPerTick;
+		nextTickCycles = (remaining + elapsedTicks * cyclesPerTick) - elapsedCycles;
+	}
+	
+	//The counter is stopped again until it is restarted below, so that much less is left to count. If the boundary is
+	//closer than that, it will have gone by before we can count to it: count it now and aim for the one after
+	if(nextTickCycles <= OS_TICKLESS_STOPPED_CYCLES + 1)
+	{
+		nextTickCycles += cyclesPerTick;
+		elapsedTicks++;
+	}
+	
+	//Restart SysTick so the next interrupt lands on the next tick boundary, then put the normal reload back.
+	//The counter has already picked up nextTickCycles by the time we change LOAD, so only later reloads see the change
+	SysTick->LOAD = nextTickCycles - OS_TICKLESS_STOPPED_CYCLES - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	SysTick->LOAD = cyclesPerTick - 1;
+	
+	catchUpTicks(skippedTicks + elapsedTicks);
+	
+	//now whatever woke us up can run
+	__enable_irq();
+}
+#endif
+
+/*
+	PendSV found that a thread went down to its canary, or wrote over it. Whatever was under its stack has been trampled, so
+	there is no safe way to keep going. We write down who it was, put it on the LEDs (plus one, so that thread 0 still lights
+	something up) and stop right here with interrupts off, so that the debugger finds everything the way it was.
+*/
+int osStackOverflowThread = NO_THREAD;
+
+void osStackOverflow(thread* overflowed)
+{
+	__disable_irq();
+	osStackOverflowThread = overflowed - osThreads;
+	LED_display(osStackOverflowThread + 1);
+	while(1);
+}
+
 /*
 	at the moment this just changes the stack from one to the other. I personally found
 	this to be easier to do in C. You may want to do more interesting things here.
-	For example, when implementing more sophisticated scheduling algorithms, perhaps now is the time
-	to figure out which thread should run, and then set PSP to its stack pointer...
+
+	This is the old C half of PendSV, which is only used when svc_call.s is built with OS_C_SWITCH defined, to compare it with
+	the all-assembly switch. savedStack is where PendSV just pushed r4-r11 for the thread we are leaving.
 */
-int task_switch(void){
-		__set_PSP((uint32_t)osThreads[osCurrentTask].taskStack); //set the new PSP
+int task_switch(uint32_t* savedStack){
+		if(osCurrentTCB != NULL)
+		{
+			osCurrentTCB->taskStack = savedStack;
+			//the same check the assembly PendSV does
+			if(osCurrentTCB->stackBase != NULL && (savedStack <= osCurrentTCB->stackBase || osCurrentTCB->stackBase[0] != STACK_CANARY))
+				osStackOverflow(osCurrentTCB);
+		}
+		osCurrentTCB = osNextTCB;
+		__set_PSP((uint32_t)osCurrentTCB->taskStack); //set the new PSP
 		return 1; //You are free to use this return value in your assembly eventually. It will be placed in r0, so be sure
 		//to access it before overwriting r0
 }
@@ -303,8 +1343,10 @@ void push(int id) {
 	osMutexes[id].queuedThreads[lastIndex] = osCurrentTask;
 }
 
-//Function to create mutexes
-void osMutexCreate (void) {
+//Function to create mutexes. Returns the mutex's ID, which is its index in every thread's mutexResources, or -1 if there are no more
+int osMutexCreate (void) {
+	if(mutexNums >= MAX_THREADS)
+		return -1;
 	mutex newMutex;
 	osMutexes[mutexNums] = newMutex;
 	osMutexes[mutexNums].id = mutexNums;
@@ -312,24 +1354,149 @@ void osMutexCreate (void) {
 	osMutexes[mutexNums].currentId = -1;
 	for(int i = 0; i < MAX_THREADS; i++)
 		osMutexes[mutexNums].queuedThreads[i] = -1;
+	osMutexes[mutexNums].ceiling = 0;
+	osMutexes[mutexNums].previousCeiling = 0;
+	osMutexes[mutexNums].previousOwner = NO_THREAD;
+	osMutexes[mutexNums].previousLock = NO_THREAD;
 	mutexNums++;
+	return mutexNums - 1;
 }
 
-//Function to allow thread to aquire mutex
-void osMutexAcquire(void){
-	for(int i=0; i<MAX_THREADS;i++){ // iterate through thread's mutex resource array
-		if (osThreads[osCurrentTask].mutexResources[i]){
-			// check global mutex array with corresponding index to see if it's available
-			if (osMutexes[i].resourceIsAvailable){
-				osMutexes[i].resourceIsAvailable = false;
-				osMutexes[i].currentId = osCurrentTask;
-			}else{
-				// add thread to queue
-				push(osCurrentTask);
-			}			
-		}
+/*
+	Function to allow thread to aquire mutex. With SRP this can't block: a timed job only ever starts when every mutex it
+	could want is free, so all we do is take it and raise the system ceiling. It fails if the thread never said it uses this
+	mutex, since then the ceiling doesn't know about it. It also fails if the mutex is taken, which SRP only rules out for
+	timed threads. RR threads have preemption level 0, so a mutex only RR threads use has a ceiling of 0 and keeps none of
+	them out. An RR thread that finds it taken gets false without being queued, and has to try again later, like after osYield.
+
+	Without SRP it is first come first served. If someone else has it we join its queue and get false, and the mutex is
+	handed to us when it's our turn, which the next call finds out.
+*/
+bool osMutexAcquire(int id){
+	return osKernelCall((uint32_t)id, 0, 0, 0, MUTEX_ACQUIRE_CALL) != 0;
+}
+
+/*
+	Releases a mutex the running thread holds. With SRP they have to be released in the opposite order they were taken,
+	and since the ceiling comes down, the scheduler gets a look in case a job that was held back can start now.
+*/
+bool osMutexRelease(int id) {
+	return osKernelCall((uint32_t)id, 0, 0, 0, MUTEX_RELEASE_CALL) != 0;
+}
+
+#if OS_SRP
+//takes the lock on top off, and puts the system ceiling back to what it was before it was taken
+static void srpUnlockTop(void)
+{
+	int id = osLockTop;
+	osSystemCeiling = osMutexes[id].previousCeiling;
+	osCeilingOwner = osMutexes[id].previousOwner;
+	osLockTop = osMutexes[id].previousLock;
+	osMutexes[id].currentId = -1;
+	osMutexes[id].resourceIsAvailable = true;
+}
+#else
+//the next thread in the queue gets the mutex, or it's free if there isn't one
+static void mutexHandOver(int id)
+{
+	int next = osMutexes[id].queuedThreads[0];
+	for(int i = 0; i < MAX_THREADS - 1; i++)
+		osMutexes[id].queuedThreads[i] = osMutexes[id].queuedThreads[i + 1];
+	osMutexes[id].queuedThreads[MAX_THREADS - 1] = -1;
+	osMutexes[id].currentId = next;
+	osMutexes[id].resourceIsAvailable = (next == -1);
+}
+#endif
+
+//the system call behind osMutexAcquire. Like every system call it runs with nothing able to get in between
+static uint32_t svcMutexAcquire(uint32_t* args)
+{
+	int id = (int)args[0];
+	args[0] = false;
+	if(osCurrentTask < 0 || id < 0 || id >= mutexNums || !osThreads[osCurrentTask].mutexResources[id])
+		return SVC_RETURN;
+	
+#if OS_SRP
+	if(!osMutexes[id].resourceIsAvailable)
+		return SVC_RETURN;
+	osMutexes[id].resourceIsAvailable = false;
+	osMutexes[id].currentId = osCurrentTask;
+	osMutexes[id].previousCeiling = osSystemCeiling;
+	osMutexes[id].previousOwner = osCeilingOwner;
+	osMutexes[id].previousLock = osLockTop;
+	osLockTop = id;
+	if(osMutexes[id].ceiling > osSystemCeiling)
+	{
+		osSystemCeiling = osMutexes[id].ceiling;
+		osCeilingOwner = osCurrentTask;
+	}
+	args[0] = true;
+#else
+	if(osMutexes[id].currentId == osCurrentTask)
+		args[0] = true; //handed to us by the last owner, or we already had it
+	else if (osMutexes[id].resourceIsAvailable){
+		osMutexes[id].resourceIsAvailable = false;
+		osMutexes[id].currentId = osCurrentTask;
+		args[0] = true;
+	}else{
+		// add thread to queue, once
+		bool queued = false;
+		for(int i = 0; i < MAX_THREADS; i++)
+			queued = queued || osMutexes[id].queuedThreads[i] == osCurrentTask;
+		if(!queued)
+			push(id);
 	}
+#endif
+	return SVC_RETURN;
+}
+
+//the system call behind osMutexRelease. With SRP it has to switch, so it can't take the fast path
+static uint32_t svcMutexRelease(uint32_t* args)
+{
+	int id = (int)args[0];
+	args[0] = false;
+	if(osCurrentTask < 0 || id < 0 || id >= mutexNums || osMutexes[id].currentId != osCurrentTask)
+		return SVC_RETURN;
+	
+#if OS_SRP
+	if(id != osLockTop)
+		return SVC_RETURN;
+	srpUnlockTop();
+	args[0] = true;
+	return SVC_SWITCH;
+#else
+	mutexHandOver(id);
+	args[0] = true;
+	return SVC_RETURN;
+#endif
 }
 
-void osMutexRelease(void) {
-}
\ No newline at end of file
+/*
+	Thread "id" is exiting, so it lets go of everything. With SRP its locks are the ones on top, since anything that preempted
+	it has let go of its own by now, and they come off in order so that the ceiling goes back to what it was before them.
+	Without SRP each mutex it holds goes to whoever is next in line, and it comes out of every queue it was waiting in so that
+	nobody hands it a mutex after it's gone.
+*/
+static void mutexReleaseAll(int id)
+{
+#if OS_SRP
+	while(osLockTop != NO_THREAD && osMutexes[osLockTop].currentId == id)
+		srpUnlockTop();
+#else
+	for(int m = 0; m < mutexNums; m++)
+	{
+		//everybody behind it moves up one
+		int kept = 0;
+		for(int i = 0; i < MAX_THREADS; i++)
+		{
+			if(osMutexes[m].queuedThreads[i] != id)
+				osMutexes[m].queuedThreads[kept++] = osMutexes[m].queuedThreads[i];
+		}
+		while(kept < MAX_THREADS)
+			osMutexes[m].queuedThreads[kept++] = -1;
+		
+		if(osMutexes[m].currentId == id)
+			mutexHandOver(m);
+	}
+#endif
+}
@@ -22,17 +22,52 @@ void kernelInit(void);
 */
 void osThreadSleep(uint32_t sleepTicks);
 
+/*
+	Sleeps the current thread until its next release, which is its last release plus its period.
+	Periodic loops should call this at the end of every job instead of osThreadSleep so that they don't drift.
+	A server returns straight away, since its deadlines come from its budget.
+*/
+void osWaitForNextPeriod(void);
+
+/*
+	Sleeps the current thread until the tick count (see osKernelGetTickCount) reaches wakeTick.
+	Returns false without sleeping if that tick has already come.
+*/
+bool osThreadSleepUntil(uint32_t wakeTick);
+
+//ends the running thread, keeping exitCode for osThreadJoin. A thread whose function returns does this with 0
+void osThreadExit(uint32_t exitCode);
+
+/*
+	Waits for thread "id" to exit and collects its exit code, which may be NULL if you don't want it. The thread's slot
+	is free for a new thread after this. Returns false if there is nothing to wait for, and only RR threads can wait.
+*/
+bool osThreadJoin(int id, uint32_t* exitCode);
+
 /*
 	The scheduler. When a new thread is ready to run, this function
 	decides which one goes. This is a round-robin scheduler for now.
 */
 void scheduler(void);
 
+//runs the scheduler from a handler that made a thread ready, if the running thread's threshold lets it. Interrupts have to be off
+void osHandlerReschedule(void);
+
 /*
 	The OS Scheduler
 */
 void osYield(void);
 
+/*
+	Makes system call "call" (see osDefs.h) with up to four arguments, and returns what it returns. It is in svc_call.s:
+	the arguments are already in r0 to r3, the call number goes in r12, and the exception entry stacks all of them for
+	SVC_Handler_Main to find.
+*/
+uint32_t osSvcCall(uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t call);
+
+//the same, but calls that never switch are run inline when the caller is privileged (see OS_FAST_CALLS). The kernel API uses this one
+uint32_t osKernelCall(uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t call);
+
 /*
 	Sets the value of PSP to threadStack and sures that the microcontroller
 	is using that value by changing the CONTROL register.
@@ -50,16 +85,49 @@ bool osKernelStart(void);
 */
 void osIdleTask(void*args);
 
-//a C function to help us to switch PSP so we don't have to do this in assembly
-int task_switch(void);
+/*
+	Returns the number of SysTick ticks since the kernel started. In tickless mode the ticks that
+	went by while we were asleep are added back in when we wake up, so this never skips.
+*/
+uint32_t osKernelGetTickCount(void);
+
+//copies out the context switch counters, so that the effect of preemption thresholds and the same-thread shortcut can be measured
+void osGetSwitchStats(switchStats* stats);
+
+//zeroes the context switch counters
+void osResetSwitchStats(void);
+
+//CRIT_LO normally, CRIT_HI from a high criticality thread's overrun until the CPU next goes idle
+uint32_t osCriticalityMode(void);
+
+//how many times the system has gone into high criticality mode
+uint32_t osCriticalitySwitchCount(void);
+
+/*
+	Tickless idle: sleeps with SysTick stretched out to the next thread wakeup, then
+	catches up the ticks that went by. Only the idle task calls this.
+*/
+#if OS_TICKLESS_IDLE
+void osTicklessSleep(void);
+#endif
+
+//PendSV calls this when a thread's stack overflowed. It never returns. osStackOverflowThread says which thread it was
+void osStackOverflow(thread* overflowed);
+
+//a C function to help us to switch PSP so we don't have to do this in assembly. Only used by the OS_C_SWITCH PendSV in svc_call.s
+int task_switch(uint32_t* savedStack);
 
 // Adding to queue
 void push(int id);
 
-//Function to create mutexes
-void osMutexCreate (void);
+//Function to create mutexes. Returns its ID, or -1 if there are already MAX_THREADS of them
+int osMutexCreate (void);
+
+//Function to allow thread to aquire mutex. The thread has to list the mutex in its mutexResources. Returns true if it has it.
+//With OS_SRP a thread that gets false isn't queued, which can only happen to RR threads, so they have to try again
+bool osMutexAcquire(int id);
 
-//Function to allow thread to aquire mutex
-void osMutexAcquire(void);
+//releases a mutex the running thread holds. With OS_SRP they have to be released in the opposite order they were taken
+bool osMutexRelease(int id);
 
 #endif
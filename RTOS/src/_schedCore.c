@@ -0,0 +1,909 @@
+#include "_schedCore.h"
+
+/*
+	The scheduling policies. This file has the ready structure and every policy built on top of it, and
+	nothing else: the kernel decides when a thread changes state and tells the policy through the hooks in _schedCore.h.
+*/
+extern thread osThreads[OS_IDLE_TASK];
+extern int threadNums;
+
+//elastic periods are left alone in high criticality mode, where the low threads' periods belong to the mode switch
+extern uint32_t osCritMode;
+
+#if OS_SRP
+//the SRP state lives with the mutexes in _kernelCore.c
+extern uint32_t osSystemCeiling;
+extern int osCeilingOwner;
+extern int osSharedTop;
+#endif
+
+/*
+	The ready structure. The idle task is never in here, it is what we fall back to when nothing else is ready.
+	Every partition has its own, so a thread always goes in and out of its partition's one, but only the partition that owns the
+	current window is ever picked from. With partitions off there is just the one and none of this costs anything.
+*/
+#if OS_PARTITIONS > 1
+readyList osReady[OS_PARTITIONS];
+int osActivePartition = 0;
+#define readyOf(id) (&osReady[osThreads[id].partition])
+#define activeReady() (&osReady[osActivePartition])
+#else
+readyList osReady[1];
+#define readyOf(id) (&osReady[0])
+#define activeReady() (&osReady[0])
+#endif
+
+#if OS_SCHED_DYNAMIC
+const schedOps* osSchedOps = &edfOps;
+#endif
+
+//cleared when a thread is let in that breaks the schedulability test, which only happens with OS_ADMISSION_REJECT off
+bool osTaskSetSchedulable = true;
+
+//empties the ready structure. Called by kernelInit
+void schedInit(void)
+{
+	for(int p = 0; p < OS_PARTITIONS; p++)
+	{
+		osReady[p].edfSize = 0;
+		osReady[p].bitmap = 0;
+		for(int i = 0; i < OS_PRIORITY_LEVELS; i++)
+		{
+			osReady[p].head[i] = NO_THREAD;
+			osReady[p].tail[i] = NO_THREAD;
+		}
+	}
+}
+
+/*
+	Switches policy when OS_SCHED_DYNAMIC is on. Threads that already exist are sitting in whatever the
+	old policy put them in, so this only works before any are created.
+*/
+bool osSchedSetPolicy(const schedOps* ops)
+{
+#if OS_SCHED_DYNAMIC
+	if(threadNums == 0 && ops != NULL)
+	{
+		osSchedOps = ops;
+		return true;
+	}
+#endif
+	return false;
+}
+
+//server threads need the deadline heap, so they can only be created when it's in use
+bool osSchedUsesDeadlines(void)
+{
+#if OS_SCHED_DYNAMIC
+	return osSchedOps == &edfOps;
+#else
+	return OS_SCHED_POLICY == SCHED_EDF;
+#endif
+}
+
+#if OS_PARTITIONS > 1
+/*
+	Time partitions. The major frame is a list of windows, each one a run of ticks owned by a single partition, and it repeats
+	forever. SysTick steps through it the same way the cyclic executive steps through its table, and whenever the owner
+	changes the scheduler is run on the new partition's ready structure. Nothing a partition does can use up another one's
+	windows: if it has nothing ready, the idle task gets the rest of its window.
+*/
+static partitionWindow osWindows[OS_MAX_WINDOWS];
+static int osWindowCount = 0;
+static int osWindowIndex = 0;
+static uint32_t osWindowLeft = 0; //0 until a schedule is set, which is how osKernelStart knows there isn't one
+uint32_t osPartitionSwitches = 0; //how many times a window boundary changed the partition
+
+bool osPartitionSetSchedule(const partitionWindow* windows, int count)
+{
+	if(windows == NULL || count <= 0 || count > OS_MAX_WINDOWS)
+		return false;
+	for(int i = 0; i < count; i++)
+	{
+		if(windows[i].partition >= OS_PARTITIONS || windows[i].length == 0)
+			return false;
+	}
+	
+	for(int i = 0; i < count; i++)
+		osWindows[i] = windows[i];
+	osWindowCount = count;
+	osWindowIndex = 0;
+	osWindowLeft = osWindows[0].length;
+	osActivePartition = osWindows[0].partition;
+	return true;
+}
+
+bool osPartitionStep(void)
+{
+	if(--osWindowLeft > 0)
+		return false;
+	
+	osWindowIndex++;
+	if(osWindowIndex == osWindowCount)
+		osWindowIndex = 0;
+	osWindowLeft = osWindows[osWindowIndex].length;
+	
+	//back to back windows for the same partition are just one long window
+	if(osWindows[osWindowIndex].partition == osActivePartition)
+		return false;
+	osActivePartition = osWindows[osWindowIndex].partition;
+	osPartitionSwitches++;
+	return true;
+}
+
+uint32_t osPartitionWindowLeft(void)
+{
+	return osWindowLeft;
+}
+
+//tickless idle slept through some ticks. It never sleeps past the end of a window, so there is no boundary to handle
+void osPartitionSkipTicks(uint32_t ticks)
+{
+	osWindowLeft -= ticks;
+}
+
+int osPartitionActive(void)
+{
+	return osActivePartition;
+}
+#endif
+
+/*
+	The deadline heap
+*/
+
+//true if thread a's deadline is strictly earlier than thread b's, using the wrap-safe comparison
+static bool deadlineBefore(int a, int b)
+{
+	return TIME_BEFORE(osThreads[a].deadline, osThreads[b].deadline);
+}
+
+//puts a thread into a heap slot and remembers where it went
+static void heapPlace(readyList* list, int index, int id)
+{
+	list->edfHeap[index] = id;
+	osThreads[id].heapIndex = index;
+}
+
+//moves the thread at index up the heap until its parent's deadline is no later than its own
+static void heapSiftUp(readyList* list, int index)
+{
+	int id = list->edfHeap[index];
+	while(index > 0)
+	{
+		int parent = (index - 1) / 2;
+		if(!deadlineBefore(id, list->edfHeap[parent]))
+			break;
+		heapPlace(list, index, list->edfHeap[parent]);
+		index = parent;
+	}
+	heapPlace(list, index, id);
+}
+
+//moves the thread at index down the heap until both of its children have later deadlines
+static void heapSiftDown(readyList* list, int index)
+{
+	int id = list->edfHeap[index];
+	while(true)
+	{
+		int child = 2 * index + 1;
+		if(child >= list->edfSize)
+			break;
+		if(child + 1 < list->edfSize && deadlineBefore(list->edfHeap[child + 1], list->edfHeap[child]))
+			child++;
+		if(!deadlineBefore(list->edfHeap[child], id))
+			break;
+		heapPlace(list, index, list->edfHeap[child]);
+		index = child;
+	}
+	heapPlace(list, index, id);
+}
+
+//puts a thread on the bottom of the heap and floats it up to wherever its deadline belongs
+static void heapInsert(int id)
+{
+	readyList* list = readyOf(id);
+	list->edfSize++;
+	heapPlace(list, list->edfSize - 1, id);
+	heapSiftUp(list, list->edfSize - 1);
+}
+
+//the last heap entry is moved into the hole we leave and then sifted whichever way it needs to go
+static void heapRemove(int id)
+{
+	readyList* list = readyOf(id);
+	int index = osThreads[id].heapIndex;
+	list->edfSize--;
+	if(index != list->edfSize)
+	{
+		heapPlace(list, index, list->edfHeap[list->edfSize]);
+		heapSiftUp(list, index);
+		heapSiftDown(list, index); //if the sift up moved anything, what's left at index already belongs there and this does nothing
+	}
+}
+
+/*
+	The priority queues
+*/
+
+//adds a thread to the back of the queue for a level and marks that level as non-empty in the bitmap
+static void queueInsert(int id, uint32_t level)
+{
+	readyList* list = readyOf(id);
+	osThreads[id].next = NO_THREAD;
+	osThreads[id].prev = list->tail[level];
+	
+	if(list->tail[level] == NO_THREAD)
+		list->head[level] = id; //the queue was empty, so we are also the head
+	else
+		osThreads[list->tail[level]].next = id;
+	
+	list->tail[level] = id;
+	list->bitmap |= 1U << level;
+}
+
+//The queues are doubly linked so we don't have to search for the thread, and if the queue ends up empty we clear its bit so the scheduler skips it
+static void queueRemove(int id, uint32_t level)
+{
+	readyList* list = readyOf(id);
+	if(osThreads[id].prev == NO_THREAD)
+		list->head[level] = osThreads[id].next;
+	else
+		osThreads[osThreads[id].prev].next = osThreads[id].next;
+	
+	if(osThreads[id].next == NO_THREAD)
+		list->tail[level] = osThreads[id].prev;
+	else
+		osThreads[osThreads[id].next].prev = osThreads[id].prev;
+	
+	osThreads[id].next = NO_THREAD;
+	osThreads[id].prev = NO_THREAD;
+	
+	if(list->head[level] == NO_THREAD)
+		list->bitmap &= ~(1U << level);
+}
+
+//the head of the most urgent non-empty level, which is just the highest set bit of the bitmap (one CLZ), or the idle task
+static int queuePickNext(void)
+{
+	readyList* list = activeReady();
+	if(list->bitmap == 0)
+		return MAX_THREADS;
+	return list->head[31 - __CLZ(list->bitmap)];
+}
+
+//sends a thread to the back of its level with a fresh quantum. It never stops being runnable
+static void queueRotate(int id, uint32_t level)
+{
+	queueRemove(id, level);
+	queueInsert(id, level);
+	osThreads[id].sliceLeft = osThreads[id].quantum;
+}
+
+/*
+	Round robin time slicing, shared by every policy. Only the thread that is actually running uses up its quantum, and when
+	the quantum runs out it goes to the back of its ready queue. If nobody else on its level wants the CPU it just keeps
+	running with a fresh quantum. Threads that are waiting their turn don't lose anything.
+*/
+static bool sliceTick(int current, uint32_t level)
+{
+	osThreads[current].sliceLeft--;
+	if(osThreads[current].sliceLeft != 0)
+		return false;
+	
+	osThreads[current].sliceLeft = osThreads[current].quantum;
+	if(osThreads[current].next == NO_THREAD)
+		return false;
+	
+	queueRotate(current, level);
+	return true;
+}
+
+/*
+	Schedulability analysis. The task set is every timed thread that exists plus, during admission, the candidate that
+	osTimedThreadNew is about to create. Passing NO_THREAD as the candidate looks at just the ones that exist.
+*/
+static bool inTaskSet(int id, int candidate)
+{
+	return id == candidate || (id < threadNums && osThreads[id].threadType != RR_THREAD && !THREAD_DONE(osThreads[id].status));
+}
+
+//utilization of a job of "wcet" ticks every "period" ticks, rounded up so that we never decide a set fits when it doesn't
+static uint32_t utilizationOf(uint32_t wcet, uint32_t period)
+{
+	return (uint32_t)(((uint64_t)wcet * OS_UTIL_SCALE + period - 1) / period);
+}
+
+static uint32_t threadUtilization(int id)
+{
+	return utilizationOf(osThreads[id].wcet, osThreads[id].period);
+}
+
+static uint32_t totalUtilization(int candidate)
+{
+	uint32_t total = 0;
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(inTaskSet(i, candidate))
+			total += threadUtilization(i);
+	}
+	return total;
+}
+
+/*
+	Response-time analysis for fixed priority. A job's worst-case response time R is its own WCET plus every job of every
+	thread at its level or above that can be released while it waits:
+
+		R = C + sum over those threads of ceil(R / T) * C
+
+	R shows up on both sides, so we start from C and iterate until it stops changing, or gives up as soon as it goes past
+	the deadline. Threads on the same level count as interference, since round robin can put them in front of us. The
+	response times are only saved if the whole set passes.
+*/
+static bool responseTimeAnalysis(int candidate)
+{
+	uint32_t responses[MAX_THREADS];
+	
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(!inTaskSet(i, candidate))
+			continue;
+		
+		uint32_t response = osThreads[i].wcet;
+		uint32_t previous = 0;
+		while(response != previous && response <= osThreads[i].period)
+		{
+			previous = response;
+			response = osThreads[i].wcet;
+			for(int j = 0; j < MAX_THREADS; j++)
+			{
+				if(j != i && inTaskSet(j, candidate) && osThreads[j].priority >= osThreads[i].priority)
+					response += ((previous + osThreads[j].period - 1) / osThreads[j].period) * osThreads[j].wcet;
+			}
+		}
+		
+		if(response > osThreads[i].period)
+			return false;
+		responses[i] = response;
+	}
+	
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(inTaskSet(i, candidate))
+			osThreads[i].responseTime = responses[i];
+	}
+	return true;
+}
+
+/*
+	Elastic compression. Think of every elastic thread as a spring whose length is its utilization at the period it asked for,
+	with its elasticity as how soft it is. If the set needs more than the whole CPU, the excess is shared out between the elastic
+	threads by elasticity. One that would have to give up more than it can (its utilization at its longest period) stops there,
+	and the rest of the springs are shared out again without it, until everything left can take its share. The rigid threads
+	are never touched. If they don't fit on their own, every elastic thread ends up at its longest period.
+
+	Each period is the wcet over its new utilization rounded up, so the utilization admission control works out from it is never
+	more than what we aimed for.
+*/
+static void elasticCompress(int candidate)
+{
+	uint32_t target[MAX_THREADS]; //the utilization each elastic thread ends up with
+	bool saturated[MAX_THREADS]; //stretched all the way to its longest period
+	for(int i = 0; i < MAX_THREADS; i++)
+		saturated[i] = false;
+	
+	bool done = false;
+	while(!done)
+	{
+		done = true;
+		uint32_t nominal = 0; //what the elastic threads that can still stretch want
+		uint32_t fixed = 0; //what everything else needs
+		uint32_t weights = 0;
+		for(int i = 0; i < MAX_THREADS; i++)
+		{
+			if(!inTaskSet(i, candidate))
+				continue;
+			if(osThreads[i].elasticity == ELASTIC_RIGID)
+				fixed += threadUtilization(i);
+			else if(saturated[i])
+				fixed += target[i];
+			else
+			{
+				nominal += utilizationOf(osThreads[i].wcet, osThreads[i].periodMin);
+				weights += osThreads[i].elasticity;
+			}
+		}
+		
+		uint32_t excess = 0;
+		if(nominal + fixed > OS_UTIL_SCALE)
+			excess = nominal + fixed - OS_UTIL_SCALE;
+		for(int i = 0; i < MAX_THREADS; i++)
+		{
+			if(!inTaskSet(i, candidate) || osThreads[i].elasticity == ELASTIC_RIGID || saturated[i])
+				continue;
+			uint32_t wanted = utilizationOf(osThreads[i].wcet, osThreads[i].periodMin);
+			uint32_t least = utilizationOf(osThreads[i].wcet, osThreads[i].periodMax);
+			uint32_t cut = (uint32_t)(((uint64_t)excess * osThreads[i].elasticity + weights - 1) / weights);
+			if(wanted < least + cut)
+			{
+				target[i] = least;
+				saturated[i] = true;
+				done = false;
+			}
+			else
+				target[i] = wanted - cut;
+		}
+	}
+	
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(!inTaskSet(i, candidate) || osThreads[i].elasticity == ELASTIC_RIGID)
+			continue;
+		uint32_t period = (uint32_t)(((uint64_t)osThreads[i].wcet * OS_UTIL_SCALE + target[i] - 1) / target[i]);
+		if(period < osThreads[i].periodMin)
+			period = osThreads[i].periodMin;
+		if(period > osThreads[i].periodMax)
+			period = osThreads[i].periodMax;
+		osThreads[i].period = period;
+	}
+}
+
+bool schedAdmitElastic(int candidate)
+{
+	uint32_t periods[MAX_THREADS];
+	for(int i = 0; i < MAX_THREADS; i++)
+		periods[i] = osThreads[i].period;
+	
+	if(osCritMode == CRIT_LO)
+		elasticCompress(candidate);
+	if(schedAdmit(candidate))
+		return true;
+	
+	if(OS_ADMISSION_REJECT)
+	{
+		for(int i = 0; i < MAX_THREADS; i++)
+			osThreads[i].period = periods[i];
+	}
+	return false;
+}
+
+//total utilization of the admitted timed threads, out of OS_UTIL_SCALE
+uint32_t osGetUtilization(void)
+{
+	return totalUtilization(NO_THREAD);
+}
+
+//the utilization left over, out of OS_UTIL_SCALE
+int32_t osGetSlack(void)
+{
+	return (int32_t)OS_UTIL_SCALE - (int32_t)osGetUtilization();
+}
+
+/*
+	Per-thread slack in ticks. Fixed priority analysis leaves a response time behind, and the slack is how far
+	that is from the deadline. Under EDF every job can grow by whatever share of the leftover utilization its period allows.
+*/
+int32_t osThreadGetSlack(int id)
+{
+	if(id < 0 || id >= threadNums || osThreads[id].threadType != TIMED_THREAD || THREAD_DONE(osThreads[id].status))
+		return 0;
+	if(osThreads[id].responseTime != 0)
+		return (int32_t)osThreads[id].period - (int32_t)osThreads[id].responseTime;
+	return (int32_t)(((int64_t)osGetSlack() * osThreads[id].period) / OS_UTIL_SCALE);
+}
+
+bool osIsSchedulable(void)
+{
+	return osTaskSetSchedulable;
+}
+
+/*
+	EDF. Timed threads are true EDF: each job has an absolute deadline and the ready ones sit in the min-heap, so the
+	earliest deadline is always edfHeap[0]. Server threads go in the heap too, keyed on their server deadline. Those two
+	always beat everything else, which goes by priority with RR inside a level.
+*/
+#if OS_SRP
+/*
+	SRP on top of EDF. The earliest deadline can only start if its preemption level is above the system ceiling. If it can't,
+	the thread holding the ceiling is what's in the way, so that goes instead (or whatever is ready by priority, if the owner
+	is an RR thread that went to sleep with the mutex, which it shouldn't). Jobs that have started are never held back.
+
+	Shared-stack jobs also have to finish in the opposite order they started. Normally EDF does that for free, but a job that
+	missed its deadline gets a later one and could end up behind a job that started on top of it, so the top job always goes first.
+*/
+static int srpPick(int candidate)
+{
+	if(!osThreads[candidate].jobStarted && osThreads[candidate].preemptLevel <= osSystemCeiling)
+	{
+		candidate = osCeilingOwner;
+		if(candidate == NO_THREAD || osThreads[candidate].status != ACTIVE)
+			return queuePickNext();
+	}
+	if(osThreads[candidate].sharedStack && osThreads[candidate].jobStarted && candidate != osSharedTop)
+		candidate = osSharedTop;
+	return candidate;
+}
+#endif
+
+int edfPickNext(void)
+{
+	readyList* list = activeReady();
+	if(list->edfSize > 0)
+	{
+#if OS_SRP
+		return srpPick(list->edfHeap[0]);
+#else
+		return list->edfHeap[0];
+#endif
+	}
+	return queuePickNext();
+}
+
+bool edfOnTick(int current)
+{
+	//timed jobs run until they are done or their deadline goes by, and servers until their budget does. Only RR threads are time sliced
+	if(osThreads[current].threadType != RR_THREAD)
+		return false;
+	return sliceTick(current, osThreads[current].priority);
+}
+
+void edfOnBlock(int id)
+{
+	if(osThreads[id].threadType != RR_THREAD)
+		heapRemove(id);
+	else
+		queueRemove(id, osThreads[id].priority);
+}
+
+void edfOnWake(int id)
+{
+	osThreads[id].sliceLeft = osThreads[id].quantum;
+	if(osThreads[id].threadType != RR_THREAD)
+		heapInsert(id);
+	else
+		queueInsert(id, osThreads[id].priority);
+}
+
+bool edfOnYield(int id)
+{
+	//for a timed thread yield means the job is done. A server has no jobs and stays where its deadline puts it, so it should sleep instead
+	if(osThreads[id].threadType == TIMED_THREAD)
+		return false;
+	if(osThreads[id].threadType == RR_THREAD)
+		queueRotate(id, osThreads[id].priority);
+	return true;
+}
+
+/*
+	With implicit deadlines, EDF meets every deadline exactly when the utilization is at most 100%. A server counts as budget/period.
+
+	With CRIT_HI threads in the set this becomes the EDF-VD test. Say U_LO is the utilization of the low threads, and U_HI(LO) and U_HI(HI) are the high
+	threads' with their optimistic and pessimistic WCETs. Low mode needs U_LO + U_HI(LO) <= 1. If U_LO + U_HI(HI) <= 1 too,
+	plain EDF can take anything and the deadlines stay real. Otherwise the high threads' deadlines are scaled by
+
+		x = U_HI(LO) / (1 - U_LO)
+
+	which is the most they can be scaled by with low mode still fitting, and high mode fits if x * U_LO + U_HI(HI) <= 1. The
+	x * U_LO is the low jobs that were already released when the switch happened. If low threads keep running in high mode at
+	a longer period, what they need at that period is added on as well, which is on the safe side.
+
+	Servers count in U_LO, but high mode leaves them alone and they keep getting their whole budget every period. So in high
+	mode they are added on in full as well, on top of being part of x * U_LO.
+*/
+bool edfAdmit(int candidate)
+{
+	uint32_t lo = 0;
+	uint32_t servers = 0; //the part of lo that is servers
+	uint32_t hiLo = 0;
+	uint32_t hiHi = 0;
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(!inTaskSet(i, candidate))
+			continue;
+		if(osThreads[i].criticality == CRIT_HI)
+		{
+			hiLo += threadUtilization(i);
+			hiHi += utilizationOf(osThreads[i].wcetHi, osThreads[i].period);
+		}
+		else
+			lo += threadUtilization(i);
+		if(osThreads[i].threadType == SERVER_THREAD)
+			servers += threadUtilization(i);
+	}
+	
+	if(lo + hiLo > OS_UTIL_SCALE)
+		return false;
+	
+	uint32_t scale = OS_UTIL_SCALE; //x, out of OS_UTIL_SCALE
+	if(lo + hiHi > OS_UTIL_SCALE)
+	{
+		//hiHi can only be above 0 if hiLo is too, so lo is below the whole CPU here
+		scale = (hiLo * OS_UTIL_SCALE + (OS_UTIL_SCALE - lo) - 1) / (OS_UTIL_SCALE - lo);
+		uint32_t carried = (uint32_t)(((uint64_t)scale * lo + OS_UTIL_SCALE - 1) / OS_UTIL_SCALE);
+		uint32_t degraded = 0;
+#if OS_CRIT_LO_PERIOD_SCALE != 0
+		degraded = (lo - servers + OS_CRIT_LO_PERIOD_SCALE - 1) / OS_CRIT_LO_PERIOD_SCALE;
+#endif
+		if(carried + hiHi + servers + degraded > OS_UTIL_SCALE)
+			return false;
+	}
+	
+	//rounding the virtual deadline down is on the safe side for the high threads, but it can't be shorter than a job
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(!inTaskSet(i, candidate))
+			continue;
+		osThreads[i].virtualDeadline = osThreads[i].period;
+		if(osThreads[i].criticality == CRIT_HI)
+		{
+			osThreads[i].virtualDeadline = (uint32_t)(((uint64_t)osThreads[i].period * scale) / OS_UTIL_SCALE);
+			if(osThreads[i].virtualDeadline < osThreads[i].wcet)
+				osThreads[i].virtualDeadline = osThreads[i].wcet;
+		}
+	}
+	return true;
+}
+
+const schedOps edfOps = { "EDF", edfPickNext, edfOnTick, edfOnBlock, edfOnWake, edfOnYield, edfAdmit };
+
+/*
+	Fixed priority. Every thread is on the priority queues, and whatever is highest always runs. That is what gives us strict
+	preemption: any time something more urgent becomes ready, SysTick or the system call that readied it runs the scheduler.
+	Threads on the same level, timed ones included, share the CPU with their quanta. There is no deadline bookkeeping at all.
+*/
+int fixedPriorityPickNext(void)
+{
+	return queuePickNext();
+}
+
+bool fixedPriorityOnTick(int current)
+{
+	return sliceTick(current, osThreads[current].priority);
+}
+
+void fixedPriorityOnBlock(int id)
+{
+	queueRemove(id, osThreads[id].priority);
+}
+
+void fixedPriorityOnWake(int id)
+{
+	osThreads[id].sliceLeft = osThreads[id].quantum;
+	queueInsert(id, osThreads[id].priority);
+}
+
+bool fixedPriorityOnYield(int id)
+{
+	if(osThreads[id].threadType == TIMED_THREAD)
+		return false;
+	queueRotate(id, osThreads[id].priority);
+	return true;
+}
+
+//the utilization bound is too pessimistic for fixed priority, so we do the exact response-time analysis instead
+bool fixedPriorityAdmit(int candidate)
+{
+	return totalUtilization(candidate) <= OS_UTIL_SCALE && responseTimeAnalysis(candidate);
+}
+
+const schedOps fixedPriorityOps = { "fixed priority", fixedPriorityPickNext, fixedPriorityOnTick, fixedPriorityOnBlock, fixedPriorityOnWake, fixedPriorityOnYield, fixedPriorityAdmit };
+
+/*
+	Plain round robin. Everybody shares RR_PRIORITY no matter what they asked for and takes turns one quantum at a time.
+	Timed threads still get released every period and still finish a job by yielding.
+*/
+int roundRobinPickNext(void)
+{
+	return queuePickNext();
+}
+
+bool roundRobinOnTick(int current)
+{
+	return sliceTick(current, RR_PRIORITY);
+}
+
+void roundRobinOnBlock(int id)
+{
+	queueRemove(id, RR_PRIORITY);
+}
+
+void roundRobinOnWake(int id)
+{
+	osThreads[id].sliceLeft = osThreads[id].quantum;
+	queueInsert(id, RR_PRIORITY);
+}
+
+bool roundRobinOnYield(int id)
+{
+	if(osThreads[id].threadType == TIMED_THREAD)
+		return false;
+	queueRotate(id, RR_PRIORITY);
+	return true;
+}
+
+//round robin makes no promises about deadlines, so all we can check is that the CPU isn't over-full
+bool roundRobinAdmit(int candidate)
+{
+	return totalUtilization(candidate) <= OS_UTIL_SCALE;
+}
+
+const schedOps roundRobinOps = { "round robin", roundRobinPickNext, roundRobinOnTick, roundRobinOnBlock, roundRobinOnWake, roundRobinOnYield, roundRobinAdmit };
+
+#if OS_SCHED_POLICY == SCHED_TABLE
+/*
+	The cyclic executive. All of the scheduling for timed threads happens once, in osSchedBuildTable, and what comes out is a
+	list of frames that repeats every hyperperiod. At run time the current frame says who runs, SysTick counts down the frame
+	and moves to the next one, and that's it. A timed thread's job is released by its newJob frame and is done when it yields
+	or waits for its next period. Whatever is left of its frames after that goes to the RR threads.
+*/
+static tableEntry osTable[OS_TABLE_MAX_ENTRIES];
+static int osTableSize = 0;
+static int osTableIndex = 0;
+static uint32_t osTableFrameLeft = 0;
+static uint32_t osTableReleased = 0; //bit n is set while thread n has a job released that it hasn't finished
+
+static uint32_t greatestCommonDivisor(uint32_t a, uint32_t b)
+{
+	while(b != 0)
+	{
+		uint32_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+//starts the frame at osTableIndex. A job that is still going when its next one is released has missed its deadline
+static void enterFrame(void)
+{
+	tableEntry* frame = &osTable[osTableIndex];
+	osTableFrameLeft = frame->length;
+	if(frame->newJob)
+	{
+		if(osTableReleased & (1U << frame->thread))
+			osThreads[frame->thread].missCount++;
+		osTableReleased |= 1U << frame->thread;
+		osThreads[frame->thread].execTicks = 0;
+	}
+}
+
+/*
+	Builds the table by running EDF ahead of time, one tick at a time, for one hyperperiod. Every job is assumed to take its
+	full WCET. Runs of ticks that go to the same job are merged into one frame. If the simulation ever has a job left over
+	when its next one is released, the set doesn't fit and the kernel doesn't start.
+*/
+bool osSchedBuildTable(void)
+{
+	uint32_t hyperperiod = 1;
+	for(int i = 0; i < threadNums; i++)
+	{
+		if(osThreads[i].threadType != TIMED_THREAD)
+			continue;
+		uint64_t lcm = (uint64_t)hyperperiod / greatestCommonDivisor(hyperperiod, osThreads[i].period) * osThreads[i].period;
+		if(lcm > OS_TABLE_MAX_TICKS)
+			return false;
+		hyperperiod = (uint32_t)lcm;
+	}
+	
+	uint32_t workLeft[MAX_THREADS] = {0};
+	uint32_t deadline[MAX_THREADS] = {0};
+	bool jobStarted[MAX_THREADS] = {false};
+	osTableSize = 0;
+	
+	for(uint32_t t = 0; t < hyperperiod; t++)
+	{
+		//release every job that is due on this tick
+		for(int i = 0; i < threadNums; i++)
+		{
+			if(osThreads[i].threadType != TIMED_THREAD || t % osThreads[i].period != 0)
+				continue;
+			if(workLeft[i] > 0)
+				return false;
+			workLeft[i] = osThreads[i].wcet;
+			deadline[i] = t + osThreads[i].period;
+			jobStarted[i] = false;
+		}
+		
+		//earliest deadline with work left gets the tick
+		int pick = NO_THREAD;
+		for(int i = 0; i < threadNums; i++)
+		{
+			if(workLeft[i] > 0 && (pick == NO_THREAD || deadline[i] < deadline[pick]))
+				pick = i;
+		}
+		
+		bool newJob = false;
+		if(pick != NO_THREAD)
+		{
+			workLeft[pick]--;
+			newJob = !jobStarted[pick];
+			jobStarted[pick] = true;
+		}
+		
+		if(osTableSize > 0 && osTable[osTableSize - 1].thread == pick && !newJob)
+			osTable[osTableSize - 1].length++;
+		else
+		{
+			if(osTableSize == OS_TABLE_MAX_ENTRIES)
+				return false;
+			osTable[osTableSize].thread = pick;
+			osTable[osTableSize].length = 1;
+			osTable[osTableSize].newJob = newJob;
+			osTableSize++;
+		}
+	}
+	
+	//the jobs due at the end of the hyperperiod have to be done too
+	for(int i = 0; i < threadNums; i++)
+	{
+		if(workLeft[i] > 0)
+			return false;
+	}
+	
+	osTableReleased = 0;
+	osTableIndex = 0;
+	enterFrame();
+	return true;
+}
+
+bool osSchedTableStep(void)
+{
+	if(--osTableFrameLeft > 0)
+		return false;
+	
+	int oldOwner = osTable[osTableIndex].thread;
+	osTableIndex++;
+	if(osTableIndex == osTableSize)
+		osTableIndex = 0;
+	enterFrame();
+	
+	//going from one RR frame to another doesn't change who should run, and the quanta deal with the RR threads
+	return oldOwner != NO_THREAD || osTable[osTableIndex].thread != NO_THREAD;
+}
+
+int tablePickNext(void)
+{
+	int owner = osTable[osTableIndex].thread;
+	if(owner != NO_THREAD && (osTableReleased & (1U << owner)) && osThreads[owner].status == ACTIVE)
+		return owner;
+	return queuePickNext();
+}
+
+bool tableOnTick(int current)
+{
+	//the table does the timed threads, so only RR threads have quanta to use up
+	if(osThreads[current].threadType == TIMED_THREAD)
+		return false;
+	return sliceTick(current, osThreads[current].priority);
+}
+
+//timed threads are never in the ready structure: the table and osTableReleased are all we need for them
+void tableOnBlock(int id)
+{
+	if(osThreads[id].threadType != TIMED_THREAD)
+		queueRemove(id, osThreads[id].priority);
+}
+
+void tableOnWake(int id)
+{
+	osThreads[id].sliceLeft = osThreads[id].quantum;
+	if(osThreads[id].threadType != TIMED_THREAD)
+		queueInsert(id, osThreads[id].priority);
+}
+
+bool tableOnYield(int id)
+{
+	//the job is done, and the table will release the next one. The thread never stops being ACTIVE
+	if(osThreads[id].threadType == TIMED_THREAD)
+		osTableReleased &= ~(1U << id);
+	else
+		queueRotate(id, osThreads[id].priority);
+	return true;
+}
+
+//the table is EDF worked out ahead of time, so the same test applies. osSchedBuildTable still has the final say
+bool tableAdmit(int candidate)
+{
+	return totalUtilization(candidate) <= OS_UTIL_SCALE;
+}
+#endif
@@ -0,0 +1,200 @@
+#ifndef _SCHEDCORE
+#define _SCHEDCORE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <LPC17xx.h>
+#include "osDefs.h"
+
+/*
+	Everything the scheduler picks from. Ready timed threads can be kept in a binary min-heap ordered by absolute deadline,
+	so the earliest deadline is always at the top and inserting or removing a job is O(log n). The other threads use one
+	FIFO per priority level plus a bitmap that says which FIFOs are non-empty. Which threads go where is up to the policy.
+*/
+typedef struct ready_list_t{
+	int edfHeap[MAX_THREADS];
+	int edfSize;
+	uint32_t bitmap;
+	int head[OS_PRIORITY_LEVELS];
+	int tail[OS_PRIORITY_LEVELS];
+}readyList;
+
+/*
+	One window of the partition schedule: "length" ticks that belong to "partition".
+*/
+typedef struct partition_window_t{
+	uint32_t partition;
+	uint32_t length;
+}partitionWindow;
+
+/*
+	One frame of the cyclic executive's table: "length" ticks that belong to "thread", or to whatever RR thread is ready if it
+	is NO_THREAD. newJob marks a thread's first frame of a new job, which is where the job is released.
+*/
+typedef struct table_entry_t{
+	int thread;
+	uint32_t length;
+	bool newJob;
+}tableEntry;
+
+/*
+	The scheduler policy interface. Everything that decides which thread runs lives behind these hooks, and
+	the kernel (SysTick, the system calls and thread creation) only ever goes through them. The kernel still owns the thread
+	states, the timer list and the context switch, so a policy never has to touch any of those.
+
+		pickNext - returns the thread that should run now, or MAX_THREADS for the idle task. Must not change anything
+		onTick   - called on every SysTick with the thread that is running. Returns true if some other thread may need to run now
+		onBlock  - a thread is leaving the runnable set because it is sleeping, waiting for its period, or its deadline went by
+		onWake   - a thread is joining the runnable set. If it is the start of a new job, the job has already been released
+		onYield  - the running thread yielded. Returns true if it is still runnable, or false if the kernel should block it until
+		           its next period
+		admit    - schedulability test for the existing timed threads plus the candidate, which is filled in but not created yet.
+		           Returns true if they can all meet their deadlines
+*/
+typedef struct sched_ops_t{
+	const char* name;
+	int (*pickNext)(void);
+	bool (*onTick)(int current);
+	void (*onBlock)(int id);
+	void (*onWake)(int id);
+	bool (*onYield)(int id);
+	bool (*admit)(int candidate);
+}schedOps;
+
+//the built-in policies
+extern const schedOps edfOps;
+extern const schedOps fixedPriorityOps;
+extern const schedOps roundRobinOps;
+
+/*
+	How the kernel calls the hooks. Normally the policy is picked at build time with OS_SCHED_POLICY, and these turn into plain
+	direct calls to that policy's functions, so having an interface costs nothing on the switch path. With OS_SCHED_DYNAMIC
+	the calls go through osSchedOps instead, which osSchedSetPolicy can change before any threads are created. That is
+	only meant for benchmarking policies against each other on the same workload in one build.
+*/
+#if OS_SCHED_DYNAMIC
+#if OS_SCHED_POLICY == SCHED_TABLE
+#error "the cyclic executive takes over the timers, so it can't be switched to at run time"
+#endif
+extern const schedOps* osSchedOps;
+#define schedPickNext osSchedOps->pickNext
+#define schedOnTick osSchedOps->onTick
+#define schedOnBlock osSchedOps->onBlock
+#define schedOnWake osSchedOps->onWake
+#define schedOnYield osSchedOps->onYield
+#define schedAdmit osSchedOps->admit
+#else
+#if OS_SCHED_POLICY == SCHED_EDF
+#define SCHED_PREFIX edf
+#elif OS_SCHED_POLICY == SCHED_FIXED_PRIORITY
+#define SCHED_PREFIX fixedPriority
+#elif OS_SCHED_POLICY == SCHED_ROUND_ROBIN
+#define SCHED_PREFIX roundRobin
+#elif OS_SCHED_POLICY == SCHED_TABLE
+#define SCHED_PREFIX table
+#else
+#error "OS_SCHED_POLICY is not a policy that exists"
+#endif
+#define SCHED_CONCAT2(a, b) a##b
+#define SCHED_CONCAT(a, b) SCHED_CONCAT2(a, b)
+#define schedPickNext SCHED_CONCAT(SCHED_PREFIX, PickNext)
+#define schedOnTick SCHED_CONCAT(SCHED_PREFIX, OnTick)
+#define schedOnBlock SCHED_CONCAT(SCHED_PREFIX, OnBlock)
+#define schedOnWake SCHED_CONCAT(SCHED_PREFIX, OnWake)
+#define schedOnYield SCHED_CONCAT(SCHED_PREFIX, OnYield)
+#define schedAdmit SCHED_CONCAT(SCHED_PREFIX, Admit)
+#endif
+
+//empties the ready structure. Called by kernelInit
+void schedInit(void);
+
+//switches policy when OS_SCHED_DYNAMIC is on. Only works before any threads exist, returns false otherwise
+bool osSchedSetPolicy(const schedOps* ops);
+
+//true if the policy in use keeps the deadline heap, which server threads need
+bool osSchedUsesDeadlines(void);
+
+#if OS_PARTITIONS > 1
+//sets the major frame to "count" windows, which are copied. Has to be called before osKernelStart. Returns false if any window is bad
+bool osPartitionSetSchedule(const partitionWindow* windows, int count);
+
+//moves the partition schedule on by a tick. Called by SysTick every tick, returns true if a different partition now owns the CPU
+bool osPartitionStep(void);
+
+//ticks until the current window ends, or 0 if no schedule has been set
+uint32_t osPartitionWindowLeft(void);
+
+//moves the current window on by ticks that went by without a SysTick. Has to be less than osPartitionWindowLeft
+void osPartitionSkipTicks(uint32_t ticks);
+
+//the partition that owns the current window
+int osPartitionActive(void);
+#endif
+
+//EDF: timed and server threads by absolute deadline from the heap, then everything else by priority
+int edfPickNext(void);
+bool edfOnTick(int current);
+void edfOnBlock(int id);
+void edfOnWake(int id);
+bool edfOnYield(int id);
+bool edfAdmit(int candidate);
+
+//Fixed priority: everybody by priority, strict preemption, round robin within a level
+int fixedPriorityPickNext(void);
+bool fixedPriorityOnTick(int current);
+void fixedPriorityOnBlock(int id);
+void fixedPriorityOnWake(int id);
+bool fixedPriorityOnYield(int id);
+bool fixedPriorityAdmit(int candidate);
+
+//Round robin: one level for everybody, priorities and deadlines are ignored
+int roundRobinPickNext(void);
+bool roundRobinOnTick(int current);
+void roundRobinOnBlock(int id);
+void roundRobinOnWake(int id);
+bool roundRobinOnYield(int id);
+bool roundRobinAdmit(int candidate);
+
+#if OS_SCHED_POLICY == SCHED_TABLE
+//Cyclic executive: timed threads from the table built by osKernelStart, RR threads by priority in the frames left over
+int tablePickNext(void);
+bool tableOnTick(int current);
+void tableOnBlock(int id);
+void tableOnWake(int id);
+bool tableOnYield(int id);
+bool tableAdmit(int candidate);
+
+//lays out the timed threads over one hyperperiod. Returns false if they don't fit in the table or can't all meet their deadlines
+bool osSchedBuildTable(void);
+
+//moves the table on by a tick. Called by SysTick every tick, returns true if a new frame started that could change who runs
+bool osSchedTableStep(void);
+#endif
+
+/*
+	Admission control with elastic periods. Stretches the elastic threads' periods as far as they need to go for the set
+	(the existing timed threads plus the candidate, or just the existing ones for NO_THREAD) to fit in the CPU, then runs the
+	policy's admit test. If the set is refused with OS_ADMISSION_REJECT on, every period is put back how it was.
+*/
+bool schedAdmitElastic(int candidate);
+
+/*
+	Schedulability queries. These describe the timed threads that have been admitted so far.
+*/
+
+//total utilization of the admitted timed threads, out of OS_UTIL_SCALE
+uint32_t osGetUtilization(void);
+
+//the utilization left over, out of OS_UTIL_SCALE. Negative if the set is overloaded, which can only happen with OS_ADMISSION_REJECT off
+int32_t osGetSlack(void);
+
+/*
+	Per-thread slack in ticks. Under fixed priority this is the thread's period minus its worst-case response time, i.e. how
+	early its worst job finishes. Under EDF it is how many more ticks each job could take before the set stops being schedulable.
+*/
+int32_t osThreadGetSlack(int id);
+
+//false once a thread has been let in that makes the set unschedulable (only possible with OS_ADMISSION_REJECT off)
+bool osIsSchedulable(void);
+
+#endif
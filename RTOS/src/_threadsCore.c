@@ -1,5 +1,7 @@
 #include "osDefs.h"
 #include "_threadsCore.h"
+#include "_schedCore.h"
+#include "_kernelCore.h"
 #include "stdio.h"
 
 /*
@@ -11,9 +13,13 @@
 extern int osCurrentTask;
 extern thread osThreads[OS_IDLE_TASK];
 
-extern int threadNums; //number of threads actually created
+extern int threadNums; //how many slots have ever been handed out
+extern int osFreeHead; //the first empty slot, or NO_THREAD if there isn't one
+extern bool osKernelRunning;
 extern int osNumThreadsRunning; //number of threads that have started runnin
 extern uint32_t mspAddr; //the initial address of the MSP
+extern bool osTaskSetSchedulable; //cleared by admission control in flag-only mode
+extern uint32_t osCritMode; //CRIT_HI from a high criticality overrun until the CPU next goes idle
 
 /*
 	Obtains the initial location of MSP by looking it up in the vector table.
@@ -26,92 +32,546 @@ uint32_t* getMSPInitialLocation()
 }
 
 /*
-	Returns the address of a new PSP with the offset "offset" bytes from MSP. Remember,
-	the stack grows downwards, so this offset must be subtracted from MSP, not added
+	The stack arena. Thread stacks used to be cut out right under the MSP, all the same size, which put them on top of the
+	startup code's MSP stack and gave a thread with a lot of locals no more room than one with none. Now they come out of
+	this array, which the linker sets aside like any other, each the size its thread asked for. A uint64_t array keeps
+	everything 8-byte aligned, which the ARM Cortex needs (and is why PRESERVE8 is in our assembly file), as long as every
+	size is a multiple of 8 too.
+*/
+static uint64_t osStackArena[OS_STACK_ARENA_SIZE / 8];
+static stackBlock* osStackFreeList = NULL;
+
+//the idle task always exists, so it gets its own stack instead of one from the arena
+static uint64_t osIdleStack[THREAD_STACK_SIZE / 8];
+
+void osStackArenaInit(void)
+{
+	osStackFreeList = (stackBlock*)osStackArena;
+	osStackFreeList->size = OS_STACK_ARENA_SIZE;
+	osStackFreeList->next = NULL;
+}
+
+/*
+	First fit. The stack is cut off the top end of the free piece, so the piece's header stays where it is and only its size
+	changes. Every size is a multiple of 8, and so is the header, so whatever is left is big enough to be a piece of its own.
+*/
+uint32_t* osStackAlloc(uint32_t size)
+{
+	size = (size + 7) & ~7U;
+	stackBlock** link = &osStackFreeList;
+	while(*link != NULL && (*link)->size < size)
+		link = &(*link)->next;
+	if(*link == NULL)
+		return NULL;
+	
+	stackBlock* block = *link;
+	block->size -= size;
+	if(block->size == 0)
+		*link = block->next;
+	return (uint32_t*)((uint8_t*)block + block->size);
+}
+
+void osStackFree(uint32_t* base, uint32_t size)
+{
+	stackBlock* block = (stackBlock*)base;
+	block->size = (size + 7) & ~7U;
+	
+	//find where it goes in address order
+	stackBlock* prev = NULL;
+	stackBlock* next = osStackFreeList;
+	while(next != NULL && next < block)
+	{
+		prev = next;
+		next = next->next;
+	}
+	
+	//a free piece right above it or right below it becomes part of the same piece
+	if(next != NULL && (uint8_t*)block + block->size == (uint8_t*)next)
+	{
+		block->size += next->size;
+		next = next->next;
+	}
+	block->next = next;
+	if(prev != NULL && (uint8_t*)prev + prev->size == (uint8_t*)block)
+	{
+		prev->size += block->size;
+		prev->next = block->next;
+	}
+	else if(prev != NULL)
+		prev->next = block;
+	else
+		osStackFreeList = block;
+}
+
+
+//whether a thread's mutex list has any mutexes in it
+static bool usesMutexes(const bool mutexResources[MAX_THREADS])
+{
+	for(int i = 0; i < MAX_THREADS; i++)
+	{
+		if(mutexResources != NULL && mutexResources[i])
+			return true;
+	}
+	return false;
+}
+
+/*
+	Paints a stack before anything is on it. The canary goes at the bottom, where an overflow hits first, and everything
+	above it gets the paint. A stack can't have gone any deeper than its deepest word that isn't paint any more.
+*/
+static void paintStack(uint32_t* base, uint32_t size)
+{
+	base[0] = STACK_CANARY;
+	for(uint32_t i = 1; i < size / 4; i++)
+		base[i] = STACK_PAINT;
+}
+
+/*
+	The priority a timed thread gets when it doesn't ask for one: rate-monotonic, so shorter periods get higher levels. Every
+	power of two of period is one level, which gives a period of 1 the top level, and nothing falls onto or below the RR level.
+*/
+static uint32_t rateMonotonicPriority(uint32_t period)
+{
+	uint32_t log2Period = 31 - __CLZ(period);
+	uint32_t level = (OS_PRIORITY_LEVELS - 1) - log2Period;
+	if(level <= RR_PRIORITY)
+		level = RR_PRIORITY + 1;
+	return level;
+}
 
-	I am also ensuring that the stack is divisible by 8, which is required by the ARM
-	Cortex (and is why PRESERVE8 is in our assembly file)
-*/	
-uint32_t* getNewThreadStack(uint32_t offset)
+//the priority decides where RR threads go in EDF mode, and where everybody goes in fixed priority mode
+static void assignPriority(int id, const threadAttr* attr)
 {
-	uint32_t MSPOriginal = (uint32_t)getMSPInitialLocation();
-	uint32_t newStackLocation = MSPOriginal-offset;
-	if(newStackLocation%EIGHT_BYTE_ALIGN)
-		newStackLocation+=FIX_ALIGNMENT;
-	return (uint32_t*)(MSPOriginal-offset);
+	if(attr != NULL && attr->priority != DEFAULT_PRIORITY)
+		osThreads[id].priority = attr->priority;
+	else if(osThreads[id].threadType == TIMED_THREAD)
+		osThreads[id].priority = rateMonotonicPriority(osThreads[id].period);
+	else
+		osThreads[id].priority = RR_PRIORITY;
 }
 
+/*
+	Builds a thread's first stack frame at the top of its stack, so that the first context switch into it "returns" to the start
+	of its function. Aborting a late job does this again to throw away whatever the old job left on the stack.
+*/
+void osThreadStackInit(int id)
+{
+	osThreadStackInitAt(id, osThreads[id].stackBase + osThreads[id].stackSize / 4);
+}
 
-//returns the thread ID, or -1 if that is not possible
-int osThreadNew(void (*tf)(void*args), bool mutexArray[MAX_THREADS])
+/*
+	Builds the frame right under "top". Shared-stack jobs get theirs wherever the shared stack is up to when they start, and
+	their LR points at osJobReturn so that returning from the thread function ends the job. Everybody else's points at
+	osThreadReturn, so returning from the thread function exits the thread.
+*/
+void osThreadStackInitAt(int id, uint32_t* top)
 {
-	if(threadNums < MAX_THREADS)
-	{		
+	osThreads[id].taskStack = top;
+	//Now we need to set up the stack
+	//First is xpsr, the status register. If bit 24 is not set and we are in thread mode we get a hard fault, so we just make sure it's set
+	*(--osThreads[id].taskStack) = 1<<24;
+	
+	//Next is the program counter, which is set to whatever the function we are running will be
+	*(--osThreads[id].taskStack) = (uint32_t)osThreads[id].threadFunction;
+	
+	//Next is a set of important registers. These values are meaningless but we are setting them to be nonzero so that the 
+	//compiler doesn't optimize out these lines
+	*(--osThreads[id].taskStack) = osThreads[id].sharedStack ? (uint32_t)osJobReturn : (uint32_t)osThreadReturn; //LR
+	*(--osThreads[id].taskStack) = 0xC; //R12
+	*(--osThreads[id].taskStack) = 0x3; //R3
+	*(--osThreads[id].taskStack) = 0x2; //R2
+	*(--osThreads[id].taskStack) = 0x1; //R1
+	*(--osThreads[id].taskStack) = 0x0; // R0
+	
+	
+	//Now we have registers R11 to R4, which again are just set to random values so that we know for sure that they exist
+	*(--osThreads[id].taskStack) = 0xB; //R11
+	*(--osThreads[id].taskStack) = 0xA; //R10
+	*(--osThreads[id].taskStack) = 0x9; //R9
+	*(--osThreads[id].taskStack) = 0x8; //R8
+	*(--osThreads[id].taskStack) = 0x7; //R7
+	*(--osThreads[id].taskStack) = 0x6; //R6
+	*(--osThreads[id].taskStack) = 0x5; //R5
+	*(--osThreads[id].taskStack) = 0x4; //R4
+}
+
+//osThreadNew without the locking. osTimedThreadNew and osServerThreadNew fill in the free list's head slot before they call it
+static int threadNew(void (*tf)(void*args), bool mutexArray[MAX_THREADS], const threadAttr* attr)
+{
+	//the bitmap only has so many levels
+	if(attr != NULL && attr->priority >= OS_PRIORITY_LEVELS)
+		return -1;
+	//a callback policy needs something to call
+	if(attr != NULL && (attr->missPolicy > MISS_CALLBACK || (attr->missPolicy == MISS_CALLBACK && attr->missHandler == NULL)))
+		return -1;
+	//a budget can't be topped up more than it can be used
+	if(attr != NULL && attr->budget != 0 && attr->budgetPeriod < attr->budget)
+		return -1;
+	if(attr != NULL && attr->partition >= OS_PARTITIONS)
+		return -1;
+	//an aborted job would leave a hole in the middle of the shared stack
+	if(attr != NULL && attr->sharedStack && (!OS_SRP || attr->missPolicy == MISS_ABORT))
+		return -1;
+	//an aborted job that held a mutex would leave the SRP ceiling up, and the mutex taken, for good
+	if(OS_SRP && attr != NULL && attr->missPolicy == MISS_ABORT && usesMutexes(mutexArray))
+		return -1;
+	if(attr != NULL && attr->stackSize != 0 && attr->stackSize < STACK_SIZE_MIN)
+		return -1;
+	
+	int id = osFreeHead;
+	if(id != NO_THREAD)
+	{
+		//only timed threads have jobs to run to completion, or a criticality, or a period to stretch
+		if(attr != NULL && (attr->sharedStack || attr->criticality != CRIT_LO || attr->elasticity != ELASTIC_RIGID) && osThreads[id].period == UNITIALIZED_THREAD_PERIOD)
+			return -1;
+		
 		for(int i = 0; i < MAX_THREADS; i++){
-			osThreads[threadNums].mutexResources[i] = mutexArray[i];
+			osThreads[id].mutexResources[i] = (mutexArray != NULL) && mutexArray[i];
 		}
 		
 		//if this is a thread created to run RR style, it still needs a period, so we have to check if the period is set or not
-		if(osThreads[threadNums].period == UNITIALIZED_THREAD_PERIOD)
-			osThreads[threadNums].period = RR_TIMEOUT;
+		if(osThreads[id].period == UNITIALIZED_THREAD_PERIOD)
+		{
+			osThreads[id].period = RR_TIMEOUT;
+			osThreads[id].threadType = RR_THREAD;
+		}
+		else if(osThreads[id].threadType != SERVER_THREAD)
+			osThreads[id].threadType = TIMED_THREAD;
+		if(osThreads[id].threadType == RR_THREAD)
+		{
+			//only timed threads take part in admission control
+			osThreads[id].wcet = 0;
+			osThreads[id].responseTime = 0;
+			osThreads[id].criticality = CRIT_LO;
+			osThreads[id].wcetHi = 0;
+			osThreads[id].virtualDeadline = osThreads[id].period;
+			osThreads[id].periodMin = osThreads[id].period;
+			osThreads[id].periodMax = osThreads[id].period;
+			osThreads[id].elasticity = ELASTIC_RIGID;
+		}
 		
-		osThreads[threadNums].timeout = osThreads[threadNums].period; //all threads start here and can be modified by specific functions
+		assignPriority(id, attr);
 		
-		osThreads[threadNums].sleepTimer = 0; //0 means "not sleeping"
-		osThreads[threadNums].status = ACTIVE; //tells the OS that it is ready but not yet run
-		osThreads[threadNums].threadFunction = tf;
-		osThreads[threadNums].taskStack = getNewThreadStack(MSR_STACK_SIZE + threadNums*THREAD_STACK_SIZE);//(uint32_t*)((mspAddr - MSR_STACK_SIZE) - (threadNums)*THREAD_STACK_SIZE);
-		//Now we need to set up the stack
-		//First is xpsr, the status register. If bit 24 is not set and we are in thread mode we get a hard fault, so we just make sure it's set
-		*(--osThreads[threadNums].taskStack) = 1<<24;
+		//SRP preemption levels go by relative deadline, which is the period. RR threads don't have one and are below everybody
+		osThreads[id].preemptLevel = 0;
+		if(osThreads[id].threadType != RR_THREAD)
+			osThreads[id].preemptLevel = 0xFFFFFFFFU - osThreads[id].period;
+		osThreads[id].jobStarted = false;
+		osThreads[id].sharedStack = (attr != NULL) && attr->sharedStack;
+		osThreads[id].sharedBelow = NO_THREAD;
 		
-		//Next is the program counter, which is set to whatever the function we are running will be
-		*(--osThreads[threadNums].taskStack) = (uint32_t)tf;
+		//the partition has to be set before the thread goes into a ready structure, since that decides which one
+		osThreads[id].partition = 0;
+		if(attr != NULL)
+			osThreads[id].partition = attr->partition;
 		
-		//Next is a set of important registers. These values are meaningless but we are setting them to be nonzero so that the 
-		//compiler doesn't optimize out these lines
-		*(--osThreads[threadNums].taskStack) = 0xE; //LR
-		*(--osThreads[threadNums].taskStack) = 0xC; //R12
-		*(--osThreads[threadNums].taskStack) = 0x3; //R3
-		*(--osThreads[threadNums].taskStack) = 0x2; //R2
-		*(--osThreads[threadNums].taskStack) = 0x1; //R1
-		*(--osThreads[threadNums].taskStack) = 0x0; // R0
+		//a threshold below our own priority would let things we already beat preempt us, which makes no sense
+		osThreads[id].preemptThreshold = 0;
+		if(attr != NULL && attr->preemptThreshold != 0)
+		{
+			if(attr->preemptThreshold >= OS_PRIORITY_LEVELS || attr->preemptThreshold < osThreads[id].priority)
+			{
+				osThreads[id].period = UNITIALIZED_THREAD_PERIOD; //so that the slot still looks unused
+				return -1;
+			}
+			osThreads[id].preemptThreshold = attr->preemptThreshold;
+		}
 		
+		//each thread can have its own RR quantum now instead of everyone sharing RR_TIMEOUT
+		osThreads[id].quantum = RR_TIMEOUT;
+		if(attr != NULL && attr->quantum != 0)
+			osThreads[id].quantum = attr->quantum;
 		
-		//Now we have registers R11 to R4, which again are just set to random values so that we know for sure that they exist
-		*(--osThreads[threadNums].taskStack) = 0xB; //R11
-		*(--osThreads[threadNums].taskStack) = 0xA; //R10
-		*(--osThreads[threadNums].taskStack) = 0x9; //R9
-		*(--osThreads[threadNums].taskStack) = 0x8; //R8
-		*(--osThreads[threadNums].taskStack) = 0x7; //R7
-		*(--osThreads[threadNums].taskStack) = 0x6; //R6
-		*(--osThreads[threadNums].taskStack) = 0x5; //R5
-		*(--osThreads[threadNums].taskStack) = 0x4; //R4
+		//what happens when a job is still running at its deadline. Only timed threads have deadlines, but RR threads get the fields too
+		osThreads[id].missPolicy = MISS_SKIP;
+		osThreads[id].missHandler = NULL;
+		if(attr != NULL)
+		{
+			osThreads[id].missPolicy = attr->missPolicy;
+			osThreads[id].missHandler = attr->missHandler;
+		}
+		osThreads[id].missCount = 0;
+		osThreads[id].overrunCount = 0;
 		
+		//a shared-stack thread's jobs run on the shared stack, so it doesn't need one of its own
+		osThreads[id].stackBase = NULL;
+		osThreads[id].stackSize = 0;
+		if(!osThreads[id].sharedStack)
+		{
+			uint32_t size = (attr != NULL && attr->stackSize != 0) ? attr->stackSize : THREAD_STACK_SIZE;
+			osThreads[id].stackBase = osStackAlloc(size);
+			if(osThreads[id].stackBase == NULL)
+			{
+				osThreads[id].period = UNITIALIZED_THREAD_PERIOD;
+				return -1;
+			}
+			osThreads[id].stackSize = (size + 7) & ~7U;
+			paintStack(osThreads[id].stackBase, osThreads[id].stackSize);
+		}
+		
+		//nothing can go wrong from here on, so the slot comes off the free list before the ready queues need its "next"
+		osFreeHead = osThreads[id].next;
+		osThreads[id].detached = (attr != NULL) && attr->detached;
+		osThreads[id].joiner = NO_THREAD;
+		osThreads[id].joinResult = NULL;
+		osThreads[id].exitCode = 0;
+		
+		//A low thread made in high mode has to start out the way criticalitySwitch left the ones that were already there, since
+		//criticalityReset treats them all the same and the high mode test only counted them like that
+		bool heldBack = false; //suspended until high mode ends
+		if(osThreads[id].threadType == TIMED_THREAD && osThreads[id].criticality == CRIT_LO && osCritMode == CRIT_HI)
+		{
+#if OS_CRIT_LO_PERIOD_SCALE == 0
+			heldBack = true;
+#else
+			osThreads[id].period *= OS_CRIT_LO_PERIOD_SCALE;
+#endif
+		}
+		
+		//threads are ready right away, so their first job is released now
+		osJobRelease(id);
+		
+		//the CPU reservation starts full, and its top ups go from when the thread was created
+		osThreads[id].budget = 0;
+		osThreads[id].budgetPeriod = 0;
+		if(osThreads[id].threadType == SERVER_THREAD)
+		{
+			osThreads[id].budget = osThreads[id].wcet;
+			osThreads[id].budgetPeriod = osThreads[id].period;
+		}
+		else if(attr != NULL && attr->budget != 0)
+		{
+			osThreads[id].budget = attr->budget;
+			osThreads[id].budgetPeriod = attr->budgetPeriod;
+		}
+		osThreads[id].budgetLeft = osThreads[id].budget;
+		osThreads[id].budgetRelease = osThreads[id].release + osThreads[id].budgetPeriod;
+		
+		osThreads[id].timeout = osThreads[id].period; //all threads start here and can be modified by specific functions
+		
+		osThreads[id].status = heldBack ? SUSPENDED : ACTIVE; //tells the OS that it is ready but not yet run
+		osThreads[id].threadFunction = tf;
+		//a shared-stack job gets its frame when it starts, since only then do we know where the shared stack is up to
+		if(!osThreads[id].sharedStack)
+			osThreadStackInit(id);
 		
 		//Now the stack is set up, the thread's SP is correct, since we've been decrementing it.
-		threadNums++;
+		//The thread is ACTIVE, so it goes on its ready queue right away. A timed thread's first deadline is one period away,
+		//so that is when its timeout goes off. RR threads only have a timeout while they sleep, and a suspended thread waits
+		//for criticalityReset to release its first job and arm its timeout
+		osThreads[id].timerNext = NO_THREAD;
+		osThreads[id].timerPrev = NO_THREAD;
+		if(!heldBack)
+		{
+			schedOnWake(id);
+			if(osThreads[id].threadType == TIMED_THREAD && OS_SCHED_POLICY != SCHED_TABLE)
+				osTimerInsert(id, osThreads[id].timeout);
+		}
+		if(id >= threadNums)
+			threadNums = id + 1;
 		osNumThreadsRunning++;
-		return threadNums - 1;
+		return id;
 	}
 	return -1;
 }
 
 
+/*
+	Admission control let a thread in, but osThreadNew still turned it down (a bad attr, or no room for its stack). Letting it in
+	may have stretched elastic periods and moved virtual deadlines to make room for it, so the set is tested again without it
+	to put them back. The slot isn't in the set any more, since it was never created.
+*/
+static void undoAdmission(int id)
+{
+	osThreads[id].period = UNITIALIZED_THREAD_PERIOD; //so the next osThreadNew doesn't think it's timed
+	osTaskSetSchedulable = schedAdmitElastic(NO_THREAD);
+}
+
 /*
 	Creates a new timed thread that has a set period.
-	This function basically sets the period then calls the regular thread create function
+	This function basically sets the period then calls the regular thread create function.
+
+	Every timed thread has to say how many ticks one of its jobs can take in the worst case. Before it is created, the
+	policy's schedulability test runs on it together with every timed thread that already exists: the utilization bound
+	under EDF, response-time analysis under fixed priority. If they can't all meet their deadlines the thread is refused,
+	or with OS_ADMISSION_REJECT off it is let in and osIsSchedulable() starts returning false.
 */
-int osTimedThreadNew(void(*tf)(void*args),uint32_t period)
+static int timedThreadNew(void(*tf)(void*args), uint32_t period, uint32_t wcet, bool mutexArray[MAX_THREADS], const threadAttr* attr)
 {
-	if(threadNums < MAX_THREADS)
+	//a job that can't fit in its own period can never make it
+	if(period == UNITIALIZED_THREAD_PERIOD || wcet == 0 || wcet > period)
+		return -1;
+	//timed threads already have their WCET and miss policy to keep them in line, and a throttled job would only miss its deadline
+	if(attr != NULL && attr->budget != 0)
+		return -1;
+	if(attr != NULL && attr->priority >= OS_PRIORITY_LEVELS)
+		return -1;
+	//high criticality needs deadlines to be virtual, and it needs to be able to drop low threads
+	uint32_t criticality = (attr != NULL) ? attr->criticality : CRIT_LO;
+	uint32_t wcetHi = (attr != NULL && attr->wcetHi != 0) ? attr->wcetHi : wcet;
+	if(criticality > CRIT_HI || (criticality == CRIT_HI && (!osSchedUsesDeadlines() || OS_SRP)))
+		return -1;
+	if(wcetHi < wcet || wcetHi > period)
+		return -1;
+	//a thread that matters enough to be CRIT_HI shouldn't be slowed down, and SRP levels and the table both need periods that stay put
+	uint32_t elasticity = (attr != NULL) ? attr->elasticity : ELASTIC_RIGID;
+	uint32_t periodMax = (elasticity != ELASTIC_RIGID) ? attr->periodMax : period;
+	if(elasticity != ELASTIC_RIGID && (periodMax < period || criticality == CRIT_HI || OS_SRP || OS_SCHED_POLICY == SCHED_TABLE))
+		return -1;
+	
+	int id = osFreeHead;
+	if(id != NO_THREAD)
 	{
-		osThreads[threadNums].period = period;
-		return osThreadNew(tf);
+		osThreads[id].period = period;
+		osThreads[id].wcet = wcet;
+		osThreads[id].threadType = TIMED_THREAD;
+		osThreads[id].responseTime = 0;
+		osThreads[id].criticality = criticality;
+		osThreads[id].wcetHi = (criticality == CRIT_HI) ? wcetHi : 0;
+		osThreads[id].virtualDeadline = period; //admission control shortens it if it needs to
+		osThreads[id].periodMin = period;
+		osThreads[id].periodMax = periodMax;
+		osThreads[id].elasticity = elasticity;
+		assignPriority(id, attr); //rate-monotonic priorities go by the period asked for, and don't move when it stretches
+		
+		if(!schedAdmitElastic(id))
+		{
+			if(OS_ADMISSION_REJECT)
+			{
+				osThreads[id].period = UNITIALIZED_THREAD_PERIOD; //so the next osThreadNew doesn't think it's timed
+				return -1;
+			}
+			osTaskSetSchedulable = false;
+		}
+		
+		int created = threadNew(tf, mutexArray, attr);
+		if(created < 0)
+			undoAdmission(id);
+		return created;
+	}
+	return -1;
+}
+
+/*
+	Creates a server thread for aperiodic work, like handling bursts of UART commands. It can use up to "budget" ticks of
+	CPU every "period" ticks, which admission control counts the same way as a timed thread's WCET over its period. Inside
+	that share it runs by EDF with the timed threads, so a burst gets handled quickly without making any of them late.
+	A server waits for work by sleeping, and only exists under SCHED_EDF since everything about it is deadlines.
+*/
+static int serverThreadNew(void(*tf)(void*args), uint32_t budget, uint32_t period, const threadAttr* attr)
+{
+	if(!osSchedUsesDeadlines())
+		return -1;
+	if(period == UNITIALIZED_THREAD_PERIOD || budget == 0 || budget > period)
+		return -1;
+	//the server's own budget is the one it gets, and it has no jobs to run to completion. Its budget can't be overrun, so it is always CRIT_LO
+	if(attr != NULL && (attr->budget != 0 || attr->sharedStack || attr->criticality != CRIT_LO || attr->elasticity != ELASTIC_RIGID))
+		return -1;
+	if(attr != NULL && attr->priority >= OS_PRIORITY_LEVELS)
+		return -1;
+	
+	int id = osFreeHead;
+	if(id != NO_THREAD)
+	{
+		osThreads[id].period = period;
+		osThreads[id].wcet = budget;
+		osThreads[id].threadType = SERVER_THREAD;
+		osThreads[id].responseTime = 0;
+		osThreads[id].criticality = CRIT_LO;
+		osThreads[id].wcetHi = 0;
+		osThreads[id].virtualDeadline = period;
+		osThreads[id].periodMin = period;
+		osThreads[id].periodMax = period;
+		osThreads[id].elasticity = ELASTIC_RIGID;
+		assignPriority(id, attr);
+		
+		if(!schedAdmitElastic(id))
+		{
+			if(OS_ADMISSION_REJECT)
+			{
+				osThreads[id].period = UNITIALIZED_THREAD_PERIOD;
+				return -1;
+			}
+			osTaskSetSchedulable = false;
+		}
+		
+		int created = threadNew(tf, NULL, attr);
+		if(created < 0)
+			undoAdmission(id);
+		return created;
 	}
 	return -1;
 }
 
+/*
+	The creation functions can be called while the kernel is running. SysTick and the other threads see the slot and the
+	ready structures change, so the whole thing happens with interrupts off. When a thread creates one, the new thread might
+	be more urgent than it, which only the scheduler can decide, so we reschedule. A handler can't make a system call, so it
+	runs the scheduler itself before it turns interrupts back on.
+
+	SRP's ceilings and the cyclic executive's table are both worked out once, by osKernelStart, from the threads there are
+	then. With OS_SRP nothing can be created after that, and with SCHED_TABLE only RR threads can.
+*/
+static bool canCreateNow(bool timed)
+{
+	if(!osKernelRunning)
+		return true;
+	return !OS_SRP && !(timed && OS_SCHED_POLICY == SCHED_TABLE);
+}
+
+static void rescheduleForNewThread(int id)
+{
+	if(id >= 0 && osKernelRunning && __get_IPSR() == 0)
+		osSvcCall(0, 0, 0, 0, RESCHEDULE_SWITCH);
+}
+
+//the part a handler does while interrupts are still off
+static void rescheduleFromHandler(int id)
+{
+	if(id >= 0 && osKernelRunning && __get_IPSR() != 0)
+		osHandlerReschedule();
+}
+
+//returns the thread ID, or -1 if that is not possible. mutexArray may be NULL if the thread uses no mutexes, and attr may be NULL for the defaults
+int osThreadNew(void (*tf)(void*args), bool mutexArray[MAX_THREADS], const threadAttr* attr)
+{
+	if(!canCreateNow(false))
+		return -1;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int id = threadNew(tf, mutexArray, attr);
+	rescheduleFromHandler(id);
+	__set_PRIMASK(primask);
+	rescheduleForNewThread(id);
+	return id;
+}
+
+int osTimedThreadNew(void(*tf)(void*args), uint32_t period, uint32_t wcet, bool mutexArray[MAX_THREADS], const threadAttr* attr)
+{
+	if(!canCreateNow(true))
+		return -1;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int id = timedThreadNew(tf, period, wcet, mutexArray, attr);
+	rescheduleFromHandler(id);
+	__set_PRIMASK(primask);
+	rescheduleForNewThread(id);
+	return id;
+}
+
+int osServerThreadNew(void(*tf)(void*args), uint32_t budget, uint32_t period, const threadAttr* attr)
+{
+	if(!canCreateNow(true))
+		return -1;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int id = serverThreadNew(tf, budget, period, attr);
+	rescheduleFromHandler(id);
+	__set_PRIMASK(primask);
+	rescheduleForNewThread(id);
+	return id;
+}
+
 /*
 	The idle task is special and lives in its own place in memory. Therefore, 
 	it has to be created on its own. We cannot rely on the regular thread create functionm
@@ -125,10 +585,12 @@ void createIdleTask(void (*tf)(void*args))
 {
 		osThreads[MAX_THREADS].timeout = 1; //os idle task runs only for one tick max
 		osThreads[MAX_THREADS].period = RR_TIMEOUT;
-		osThreads[MAX_THREADS].sleepTimer = 0; //0 means "not sleeping"
 		osThreads[MAX_THREADS].status = ACTIVE; //tells the OS that it is ready but not yet run
 		osThreads[MAX_THREADS].threadFunction = tf;
-		osThreads[MAX_THREADS].taskStack = getNewThreadStack(MSR_STACK_SIZE + (MAX_THREADS)*THREAD_STACK_SIZE);
+		osThreads[MAX_THREADS].stackBase = (uint32_t*)osIdleStack;
+		osThreads[MAX_THREADS].stackSize = sizeof(osIdleStack);
+		paintStack(osThreads[MAX_THREADS].stackBase, osThreads[MAX_THREADS].stackSize);
+		osThreads[MAX_THREADS].taskStack = osThreads[MAX_THREADS].stackBase + osThreads[MAX_THREADS].stackSize / 4;
 		//Now we need to set up the stack
 		
 		//First is xpsr, the status register. If bit 24 is not set and we are in thread mode we get a hard fault, so we just make sure it's set
@@ -157,3 +619,99 @@ void createIdleTask(void (*tf)(void*args))
 		*(--osThreads[MAX_THREADS].taskStack) = 0x5; //R5
 		*(--osThreads[MAX_THREADS].taskStack) = 0x4; //R4
 }
+
+/*
+	Changes what happens when one of a thread's jobs misses its deadline. handler is only used by MISS_CALLBACK, and is
+	called from inside SysTick, so it has to be short and must not make system calls. Returns false for a bad thread or policy.
+*/
+bool osThreadSetMissPolicy(int id, uint32_t policy, void (*handler)(int id))
+{
+	if(id < 0 || id >= threadNums || THREAD_DONE(osThreads[id].status) || policy > MISS_CALLBACK || (policy == MISS_CALLBACK && handler == NULL))
+		return false;
+	if(policy == MISS_ABORT && (osThreads[id].sharedStack || (OS_SRP && usesMutexes(osThreads[id].mutexResources))))
+		return false;
+	
+	//SysTick reads both of these, so it can't be allowed to see one changed without the other
+	__disable_irq();
+	osThreads[id].missPolicy = policy;
+	osThreads[id].missHandler = handler;
+	__enable_irq();
+	return true;
+}
+
+/*
+	Changes how long a timed thread's jobs can take, for when the work it does changes while the system is running. The whole
+	set goes through admission control again, so elastic threads stretch or spring back to fit the new load. If it doesn't
+	fit the old WCET stays, unless OS_ADMISSION_REJECT is off. New periods start from each thread's next release.
+*/
+bool osThreadSetWcet(int id, uint32_t wcet)
+{
+	if(id < 0 || id >= threadNums || THREAD_DONE(osThreads[id].status) || osThreads[id].threadType != TIMED_THREAD || wcet == 0 || wcet > osThreads[id].periodMin)
+		return false;
+	if(osThreads[id].criticality == CRIT_HI && wcet > osThreads[id].wcetHi)
+		return false;
+	//the table is laid out once, from the WCETs it had at the start
+	if(OS_SCHED_POLICY == SCHED_TABLE)
+		return false;
+	
+	//SysTick reads the periods, so it can't see the set half way through changing
+	__disable_irq();
+	uint32_t previous = osThreads[id].wcet;
+	osThreads[id].wcet = wcet;
+	bool admitted = schedAdmitElastic(NO_THREAD);
+	if(!admitted && OS_ADMISSION_REJECT)
+		osThreads[id].wcet = previous;
+	else
+		osTaskSetSchedulable = admitted; //the whole set was just tested, so this can go back to true as well
+	__enable_irq();
+	return admitted || !OS_ADMISSION_REJECT;
+}
+
+//the period a timed thread is on right now. For an elastic thread this can be longer than the one it asked for
+uint32_t osThreadGetPeriod(int id)
+{
+	if(id < 0 || id >= threadNums)
+		return 0;
+	return osThreads[id].period;
+}
+
+//the number of jobs this thread has had still running at their deadline
+uint32_t osThreadGetMissCount(int id)
+{
+	if(id < 0 || id >= threadNums)
+		return 0;
+	return osThreads[id].missCount;
+}
+
+//the number of jobs this thread has had run for longer than the WCET it declared
+uint32_t osThreadGetOverrunCount(int id)
+{
+	if(id < 0 || id >= threadNums)
+		return 0;
+	return osThreads[id].overrunCount;
+}
+
+/*
+	The most stack thread "id" has ever used, in bytes, found by looking for where the paint stops. MAX_THREADS gives the idle
+	task's. Run everything through its worst case, then this plus some room to spare is what the thread's stackSize can be
+	trimmed to. Anything that was pushed but happened to be the same as STACK_PAINT is missed, which only makes it too low
+	by a word or two. 0 for a shared-stack thread or a slot with nothing in it.
+*/
+uint32_t osThreadGetStackHighWater(int id)
+{
+	if(id < 0 || id > MAX_THREADS || (id < MAX_THREADS && id >= threadNums) || osThreads[id].stackBase == NULL)
+		return 0;
+	uint32_t words = osThreads[id].stackSize / 4;
+	uint32_t untouched = 1; //the canary
+	while(untouched < words && osThreads[id].stackBase[untouched] == STACK_PAINT)
+		untouched++;
+	return (words - untouched) * 4;
+}
+
+//how big thread "id"'s stack is in bytes, so that the high-water mark can be compared to it. MAX_THREADS gives the idle task's
+uint32_t osThreadGetStackSize(int id)
+{
+	if(id < 0 || id > MAX_THREADS || (id < MAX_THREADS && id >= threadNums))
+		return 0;
+	return osThreads[id].stackSize;
+}
@@ -5,24 +5,48 @@
 #include <LPC17xx.h>
 #include "osDefs.h"
 
-//stack alignment stuff
-#define EIGHT_BYTE_ALIGN 8
-#define FIX_ALIGNMENT 4
+/*
+	A free piece of the stack arena. It lives in the free memory itself, and the free pieces are kept in address order so
+	that a stack that is given back can be merged with its neighbours
+*/
+typedef struct stack_block_t{
+	uint32_t size; //bytes, including this header
+	struct stack_block_t* next; //the next free piece up, or NULL
+}stackBlock;
 
 /*
 	Obtains the initial location of MSP by looking it up in the vector table
 */
 uint32_t* getMSPInitialLocation(void);
+
+//returns the thread ID, or -1 if that is not possible. mutexArray may be NULL if the thread uses no mutexes, and attr may be NULL for the defaults.
+//These all work while the kernel is running too, except with OS_SRP, and under SCHED_TABLE only for RR threads. IDs of threads that are gone get reused
+int osThreadNew(void (*tf)(void*args), bool mutexArray[MAX_THREADS], const threadAttr* attr);
+
+//sets the thread's period and worst-case execution time (both in ticks), runs admission control, then calls osThread new. Returns -1 if refused.
+//mutexArray lists the mutexes its jobs use, which SRP needs to work out the ceilings. It may be NULL.
+//For a CRIT_HI thread wcet is the optimistic WCET used in low mode, and attr->wcetHi is the pessimistic one
+int osTimedThreadNew(void(*tf)(void*args), uint32_t period, uint32_t wcet, bool mutexArray[MAX_THREADS], const threadAttr* attr);
+
+//creates an aperiodic thread behind a constant bandwidth server with "budget" ticks every "period". SCHED_EDF only. Returns -1 if refused
+int osServerThreadNew(void(*tf)(void*args), uint32_t budget, uint32_t period, const threadAttr* attr);
+
 /*
-	Returns the address of a new PSP with the offset "offset" bytes from MSP. Remember,
-	the stack grows downwards, so this offset must be subtracted from MSP, not added
-*/	
-uint32_t* getNewThreadStack(uint32_t offset);
+	Deadline miss handling. The policy can also be set when the thread is created, through threadAttr.
+	The counters keep going up for as long as the thread exists.
+*/
+bool osThreadSetMissPolicy(int id, uint32_t policy, void (*handler)(int id));
+uint32_t osThreadGetMissCount(int id);
+uint32_t osThreadGetOverrunCount(int id);
+
+//changes a timed thread's WCET and re-runs admission control, which stretches or restores elastic periods. False if refused
+bool osThreadSetWcet(int id, uint32_t wcet);
 
-//returns the thread ID, or -1 if that is not possible
-int osThreadNew(void (*tf)(void*args), bool mutexArray[MAX_THREADS]);
+//a timed thread's current period, which for an elastic thread depends on the load
+uint32_t osThreadGetPeriod(int id);
 
-//sets the thread's period, then calls osThread new
-int osTimedThreadNew(void(*tf)(void*args),uint32_t period); 
+//the most stack a thread has ever used and how much it has, in bytes. Pass MAX_THREADS for the idle task
+uint32_t osThreadGetStackHighWater(int id);
+uint32_t osThreadGetStackSize(int id);
 #endif
 
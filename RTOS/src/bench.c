@@ -0,0 +1,312 @@
+// Cycle-count benchmarks for the kernel
+
+#include <LPC17xx.h>
+#include <stdio.h>
+#include "bench.h"
+#include "_threadsCore.h"
+#include "_kernelCore.h"
+#include "_schedCore.h"
+
+#define BENCH_ITERATIONS 1000
+
+extern int osCurrentTask;
+extern thread osThreads[OS_IDLE_TASK];
+extern int threadNums;
+extern int osNumThreadsRunning;
+extern int osTimerHead;
+extern uint32_t osTickCount;
+
+void SysTick_Handler(void);
+
+void bench_setup(void) {
+	// the cycle counter lives in the DWT unit, which is off until trace is enabled
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t bench_read(void) {
+	return DWT->CYCCNT;
+}
+
+void bench_reset(benchStat* stat) {
+	stat->count = 0;
+	stat->min = 0xFFFFFFFFU;
+	stat->max = 0;
+	stat->total = 0;
+}
+
+void bench_record(benchStat* stat, uint32_t cycles) {
+	stat->count++;
+	stat->total += cycles;
+	if (cycles < stat->min) stat->min = cycles;
+	if (cycles > stat->max) stat->max = cycles;
+}
+
+void bench_print(const char* name, benchStat* stat) {
+	if (stat->count == 0) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+	printf("%s: min %u avg %u max %u cycles (%u samples)\n", name, stat->min, stat->total / stat->count, stat->max, stat->count);
+}
+
+// the benchmark threads never actually run, they just have to exist. That makes the smallest stack plenty for them
+static void benchThread(void* args) {
+	while (1);
+}
+static const threadAttr benchThreadAttr = { .stackSize = STACK_SIZE_MIN };
+
+// Throws away every thread so that each benchmark starts from an empty kernel. The kernel isn't running yet, so this is safe
+static void benchResetThreads(void) {
+	threadNums = 0;
+	osNumThreadsRunning = 0;
+	osTimerHead = NO_THREAD;
+	kernelInit();
+}
+
+// The search the scheduler used to do before the ready bitmap, kept here only so we can print it next to the new one
+static void linearScan(void) {
+	uint32_t earliestDeadline = WORST_CASE_DEADLINE;
+	osCurrentTask = MAX_THREADS;
+	for (int i = 0; i < threadNums; i++) {
+		if (osThreads[i].timeout != 0 && osThreads[i].status == ACTIVE && earliestDeadline > osThreads[i].timeout) {
+			earliestDeadline = osThreads[i].timeout;
+			osCurrentTask = i;
+		}
+	}
+}
+
+void bench_scheduler(void) {
+	static const int sizes[] = { 3, 4, 8, 16, 24, 32 };
+	benchStat pick, yieldPath, linear;
+
+	bench_setup();
+	benchResetThreads();
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= MAX_THREADS; s++) {
+		// half the threads are timed with different periods so the EDF heap has real work to do, the rest are RR.
+		// One tick of WCET every 64 or more ticks keeps the whole set well inside admission control
+		while (threadNums < sizes[s]) {
+			if (threadNums % 2)
+				osTimedThreadNew(benchThread, 64U << (threadNums % 6), 1, NULL, &benchThreadAttr);
+			else
+				osThreadNew(benchThread, NULL, &benchThreadAttr);
+		}
+
+		bench_reset(&pick);
+		bench_reset(&yieldPath);
+		bench_reset(&linear);
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			uint32_t start = bench_read();
+			scheduler();
+			bench_record(&pick, bench_read() - start);
+
+			// a yield or sleep also takes the running thread off its queue and a wakeup puts it back, so time all of it
+			int current = osCurrentTask;
+			start = bench_read();
+			schedOnBlock(current);
+			scheduler();
+			schedOnWake(current);
+			bench_record(&yieldPath, bench_read() - start);
+
+			start = bench_read();
+			linearScan();
+			bench_record(&linear, bench_read() - start);
+		}
+
+		printf("--- %d threads ---\n", threadNums);
+		bench_print("pick next", &pick);
+		bench_print("remove+pick+insert", &yieldPath);
+		bench_print("old linear scan", &linear);
+	}
+}
+
+// What SysTick used to do on every tick: count down every thread's timeout and check both transitions
+static void perThreadTick(void) {
+	for (int i = 0; i < threadNums; i++) {
+		osThreads[i].timeout--;
+		if (osThreads[i].timeout == 0 && osThreads[i].status == WAITING)
+			osThreads[i].timeout = osThreads[i].period;
+		else if (osThreads[i].timeout == 0 && osThreads[i].status == ACTIVE)
+			osThreads[i].timeout = osThreads[i].period;
+	}
+}
+
+void bench_tick(void) {
+	static const int sizes[] = { 3, 4, 8, 16, 24, 32 };
+	benchStat tick, oldTick;
+
+	bench_setup();
+	benchResetThreads();
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= MAX_THREADS; s++) {
+		while (threadNums < sizes[s])
+			osThreadNew(benchThread, NULL, &benchThreadAttr);
+
+		// put everybody to sleep for longer than the benchmark runs, each on a different tick, so the
+		// timer list is as long as it can be but nothing ever expires and SysTick never switches
+		for (int i = 0; i < threadNums; i++) {
+			if (osThreads[i].status == ACTIVE)
+				schedOnBlock(i);
+			osThreads[i].status = WAITING;
+			osThreads[i].timeout = 2 * BENCH_ITERATIONS + i;
+			osTimerRemove(i);
+			osTimerInsert(i, osThreads[i].timeout);
+		}
+
+		bench_reset(&tick);
+		bench_reset(&oldTick);
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			uint32_t start = bench_read();
+			SysTick_Handler();
+			bench_record(&tick, bench_read() - start);
+
+			start = bench_read();
+			perThreadTick();
+			bench_record(&oldTick, bench_read() - start);
+		}
+
+		printf("--- %d sleeping threads ---\n", threadNums);
+		bench_print("SysTick_Handler", &tick);
+		bench_print("old per-thread countdown", &oldTick);
+	}
+}
+
+// What an SVC costs for a call that never switches: the exception entry and exit, the dispatch and the handler, against the
+// same handler run inline by osKernelCall. The plain read of the tick count is there to show what is left once the SVC is gone
+void bench_syscall(void) {
+	benchStat svcTick, fastTick, rawTick, svcMutex, fastMutex;
+
+	bench_setup();
+	benchResetThreads();
+
+#if !OS_SRP
+	// the mutex calls need a thread that is allowed to use the mutex to be the one running
+	bool mutexUse[MAX_THREADS] = {true};
+	osThreadNew(benchThread, mutexUse, &benchThreadAttr);
+	osCurrentTask = 0;
+	int mutexId = osMutexCreate();
+#endif
+
+	bench_reset(&svcTick);
+	bench_reset(&fastTick);
+	bench_reset(&rawTick);
+	bench_reset(&svcMutex);
+	bench_reset(&fastMutex);
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		volatile uint32_t ticks;
+		uint32_t start = bench_read();
+		ticks = osSvcCall(0, 0, 0, 0, TICK_COUNT_CALL);
+		bench_record(&svcTick, bench_read() - start);
+
+		start = bench_read();
+		ticks = osKernelCall(0, 0, 0, 0, TICK_COUNT_CALL);
+		bench_record(&fastTick, bench_read() - start);
+
+		start = bench_read();
+		ticks = osTickCount;
+		bench_record(&rawTick, bench_read() - start);
+		(void)ticks;
+
+#if !OS_SRP
+		// with SRP a release goes back through the scheduler, which we can't do before the kernel starts
+		start = bench_read();
+		osSvcCall((uint32_t)mutexId, 0, 0, 0, MUTEX_ACQUIRE_CALL);
+		osSvcCall((uint32_t)mutexId, 0, 0, 0, MUTEX_RELEASE_CALL);
+		bench_record(&svcMutex, bench_read() - start);
+
+		start = bench_read();
+		osKernelCall((uint32_t)mutexId, 0, 0, 0, MUTEX_ACQUIRE_CALL);
+		osKernelCall((uint32_t)mutexId, 0, 0, 0, MUTEX_RELEASE_CALL);
+		bench_record(&fastMutex, bench_read() - start);
+#endif
+	}
+
+	printf("--- system calls that don't switch ---\n");
+	bench_print("tick count through SVC", &svcTick);
+	bench_print("tick count fast path", &fastTick);
+	bench_print("tick count plain read", &rawTick);
+	bench_print("uncontended mutex acquire+release through SVC", &svcMutex);
+	bench_print("uncontended mutex acquire+release fast path", &fastMutex);
+}
+
+// The context switch on its own: from pending PendSV in one thread to the first instruction back in the other one. That is
+// the exception entry, PendSV and the exception return, with no SVC and no scheduler in it. Two RR threads hand the CPU back
+// and forth by doing what SVC_Handler_Main would, but from thread mode. Build once as it is and once with OS_C_SWITCH defined
+// for the assembler to compare the all-assembly PendSV with the old one that calls task_switch
+static volatile uint32_t switchStart = 0;
+static benchStat switchStat;
+
+static void benchSwitchThread(void* args) {
+	while (1) {
+		uint32_t now = bench_read();
+		if (switchStart != 0 && switchStat.count < BENCH_ITERATIONS) {
+			bench_record(&switchStat, now - switchStart);
+			if (switchStat.count == BENCH_ITERATIONS)
+				bench_print("PendSV context switch", &switchStat);
+		}
+
+		__disable_irq();
+		schedOnYield(osCurrentTask);
+		scheduler();
+		switchStart = bench_read();
+		_ICSR |= 1<<28;
+		__enable_irq(); // PendSV goes off right here
+	}
+}
+
+void bench_switch(void) {
+	bench_setup();
+	benchResetThreads();
+	bench_reset(&switchStat);
+
+	printf("--- context switch ---\n");
+	osThreadNew(benchSwitchThread, NULL, NULL);
+	osThreadNew(benchSwitchThread, NULL, NULL);
+	osKernelStart();
+}
+
+#if OS_PARTITIONS > 1
+// What temporal isolation costs: a window boundary is a step of the partition schedule plus a pick from the new partition.
+// Every window is one tick long so that every step is a boundary, which is the worst case
+void bench_partition(void) {
+	static const int sizes[] = { 3, 4, 8, 16, 24, 32 };
+	partitionWindow windows[OS_PARTITIONS];
+	benchStat boundary, pick;
+
+	bench_setup();
+	benchResetThreads();
+	for (int p = 0; p < OS_PARTITIONS; p++) {
+		windows[p].partition = p;
+		windows[p].length = 1;
+	}
+	osPartitionSetSchedule(windows, OS_PARTITIONS);
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= MAX_THREADS; s++) {
+		// deal the threads out over the partitions
+		while (threadNums < sizes[s]) {
+			threadAttr attr = benchThreadAttr;
+			attr.partition = threadNums % OS_PARTITIONS;
+			osThreadNew(benchThread, NULL, &attr);
+		}
+
+		bench_reset(&boundary);
+		bench_reset(&pick);
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			uint32_t start = bench_read();
+			osPartitionStep();
+			scheduler();
+			bench_record(&boundary, bench_read() - start);
+
+			start = bench_read();
+			scheduler();
+			bench_record(&pick, bench_read() - start);
+		}
+
+		printf("--- %d threads in %d partitions ---\n", threadNums, OS_PARTITIONS);
+		bench_print("window boundary", &boundary);
+		bench_print("pick next alone", &pick);
+	}
+}
+#endif
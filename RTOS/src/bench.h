@@ -0,0 +1,38 @@
+// Cycle-count benchmarks for the kernel
+
+// Everything here is measured with the DWT cycle counter, so results are in CPU clock cycles.
+// These are only built into main when OS_BENCHMARK is set in osDefs.h
+
+#include <stdint.h>
+#include "osDefs.h"
+
+//running statistics for one measured operation
+typedef struct bench_stat_t{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t total;
+}benchStat;
+
+void bench_setup(void);
+uint32_t bench_read(void);
+void bench_reset(benchStat* stat);
+void bench_record(benchStat* stat, uint32_t cycles);
+void bench_print(const char* name, benchStat* stat);
+
+//times the scheduler's pick-next decision with 3 up to MAX_THREADS threads. Call after kernelInit, before osKernelStart
+void bench_scheduler(void);
+
+//times SysTick_Handler with 3 up to MAX_THREADS threads all asleep. Call after kernelInit, before osKernelStart
+void bench_tick(void);
+
+//times the non-switching system calls through the SVC against the fast path. Call after kernelInit, before osKernelStart
+void bench_syscall(void);
+
+//times PendSV handing the CPU between two threads. This starts the kernel and never returns, so it has to be the last one
+void bench_switch(void);
+
+#if OS_PARTITIONS > 1
+//times a partition window boundary against a plain pick. Call after kernelInit, before osKernelStart
+void bench_partition(void);
+#endif
@@ -18,15 +18,175 @@
 
 //My own stack defines
 #define MSR_STACK_SIZE 0x400
-#define THREAD_STACK_SIZE 0x200
+#define THREAD_STACK_SIZE 0x200 //what a thread's stack is if it doesn't ask for a size in threadAttr
+#define STACK_SIZE_SMALL 0x100 //plenty for a thread that doesn't printf or do floating point
+#define STACK_SIZE_LARGE 0x800 //for something like the sensor fusion, which keeps floats and matrices on its stack
+#define STACK_SIZE_MIN 0x80 //the first frame is 64 bytes, so anything less couldn't even start
+
+/*
+	Stack checking. Every stack is painted with STACK_PAINT when its thread is created, so how deep it has ever gone is
+	wherever the paint stops (see osThreadGetStackHighWater). The very bottom word is STACK_CANARY instead, and PendSV
+	checks it every time it switches away from a thread, along with whether the saved stack pointer got down to it.
+	svc_call.s has its own copy of the canary, so change both together
+*/
+#define STACK_PAINT 0xA5A5A5A5U
+#define STACK_CANARY 0xC0DEC0DEU
+
+//Set this to 1 to build the cycle-count benchmarks in bench.c instead of the demo threads in main
+#define OS_BENCHMARK 0
 
 //Some kernel-specific stuff. TMost of these should be modifiable by the programmer
+#if OS_BENCHMARK
+#define MAX_THREADS 32 //the benchmarks fill the thread table all the way up to show that switch cost doesn't grow
+#define OS_STACK_ARENA_SIZE 0x1400 //the benchmark threads never run, so they get the smallest stacks there are
+#else
 #define MAX_THREADS 3 //I am choosing to set this statically
-#define RR_TIMEOUT 10 //10ms for now
+#define OS_STACK_ARENA_SIZE 0x1000 //every thread's stack comes out of this, see osStackAlloc. It has to be a multiple of 8
+#endif
+#define RR_TIMEOUT 10 //10ms for now. This is the default RR quantum, threads can ask for their own with threadAttr
 #define UNITIALIZED_THREAD_PERIOD 0 //a period of 0 can never run
 #define WORST_CASE_DEADLINE 0xFFFFFFFFU //the biggest deadline we can possibly get, to ensure that we find the earliest deadline
 #define OS_IDLE_TASK MAX_THREADS+1 //the idle task is hidden from the user
 #define OS_TICK_FREQ SystemCoreClock/1000
+#define OS_TICK_US 1000 //microseconds per tick, to match OS_TICK_FREQ
+#define US_TO_TICKS(us) (((us) + OS_TICK_US - 1) / OS_TICK_US) //rounds up, so a budget in microseconds is never cut short
+
+/*
+	Tickless idle. When only the idle task can run, it stretches SysTick out to the next wakeup and sleeps
+	with WFI instead of taking a useless interrupt every millisecond. Set to 0 to keep the plain 1 ms tick.
+*/
+#define OS_TICKLESS_IDLE 1
+#define OS_TICKLESS_MIN_TICKS 2 //sleeping for less than this isn't worth reprogramming the timer, so we just WFI until the next tick
+/*
+	How many cycles SysTick is stopped for each time osTicklessSleep reprograms it, from stopping it to starting it again.
+	Nothing counts those cycles, so they are taken off the next count instead, like FreeRTOS's missed counts factor. It
+	depends on the compiler and its settings, so measure it with the DWT cycle counter if you change them
+*/
+#define OS_TICKLESS_STOPPED_CYCLES 40
+
+/*
+	The ready structure. Every priority level has its own FIFO of ready threads, and bit n of a 32-bit
+	bitmap is set whenever level n has at least one thread in it. Finding the next thread is then a single
+	CLZ instruction plus a table lookup no matter how many threads exist. Higher numbers are more urgent.
+*/
+#define OS_PRIORITY_LEVELS 32 //one level per bit of the bitmap. CLZ only works on 32 bits so this can't grow
+#define RR_PRIORITY 1 //round robin threads all share the lowest level that isn't reserved
+#define NO_THREAD -1 //marks the end of a ready queue
+
+/*
+	Timed threads are scheduled EDF, and their jobs carry an absolute release time and deadline in SysTick ticks.
+	The tick count is 32 bits and wraps after about 49 days at 1 kHz, so times are never compared directly. Instead we look
+	at the sign of the difference, which is right as long as the two times are less than 2^31 ticks apart.
+*/
+#define TIME_BEFORE(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+
+//thread types. RR threads use the priority bitmap, timed threads use the EDF heap (unless we are in fixed priority mode)
+#define RR_THREAD 0
+#define TIMED_THREAD 1
+
+/*
+	A server thread is an aperiodic thread behind a constant bandwidth server (CBS). It gets a budget of ticks per period and is
+	scheduled EDF by a server deadline, right alongside the timed threads. Running out of budget doesn't stop it: the budget is
+	refilled and the deadline is pushed back a period, so it just gets less urgent. That way it can never use more than its
+	share of the CPU, but it still runs right away when it's woken with nothing else due. Servers only exist under SCHED_EDF.
+*/
+#define SERVER_THREAD 2
+
+/*
+	Scheduling policy, picked at compile time. The policies themselves are in _schedCore.c.
+	
+	SCHED_EDF: timed threads are EDF from the deadline heap and always beat RR threads, which go by priority.
+	SCHED_FIXED_PRIORITY: every thread goes by priority only, with strict preemption and round robin between threads on the same
+	level. Timed threads that don't ask for a priority get a rate-monotonic one from their period. There is no deadline
+	bookkeeping in the pick at all, so it is the CLZ lookup every time.
+	SCHED_ROUND_ROBIN: everybody takes turns on one level, one quantum at a time.
+	SCHED_TABLE: a cyclic executive. osKernelStart lays out every job of every timed thread over one hyperperiod in a table of
+	frames, and from then on SysTick just steps through it. Timed threads have no timeouts and there is no searching at all,
+	so dispatch always costs the same. RR threads get the frames no timed thread needs. Tickless idle is off in this mode.
+*/
+#define SCHED_EDF 0
+#define SCHED_FIXED_PRIORITY 1
+#define SCHED_ROUND_ROBIN 2
+#define SCHED_TABLE 3
+#define OS_SCHED_POLICY SCHED_EDF
+
+//limits on the cyclic executive's table. osKernelStart fails if the timed threads don't fit
+#define OS_TABLE_MAX_TICKS 10000 //longest hyperperiod (the LCM of the periods) we are willing to lay out
+#define OS_TABLE_MAX_ENTRIES 64 //frames in the table. Each one is a run of ticks given to one thread, or to the RR threads
+
+//Set to 1 to call the policy through a table that osSchedSetPolicy can change, for comparing policies in one build. Costs an indirect call per hook
+#define OS_SCHED_DYNAMIC 0
+
+/*
+	Time partitions, ARINC 653 style. Every thread belongs to one partition, and a repeating major frame of windows (set with
+	osPartitionSetSchedule) says which partition owns the CPU on every tick. Inside its windows a partition runs the normal
+	policy on its own ready structure, so no amount of load in one partition can take time from another. 1 turns this off.
+*/
+#define OS_PARTITIONS 1
+#define OS_MAX_WINDOWS 16 //windows in one major frame
+
+/*
+	Stack Resource Policy (SRP). Every timed thread gets a preemption level from its period, since that is its relative
+	deadline (shorter is higher), and every mutex gets a ceiling: the highest level of any thread that lists it in its
+	mutexResources. While mutexes are held the system ceiling is the highest of their ceilings, and a job can only start if
+	its level is above it. So once a job has started it will never find a mutex taken, which means no mutex blocking and no
+	deadlock, and it also means jobs that run to completion can all share one stack instead of having one each.
+*/
+#define OS_SRP 0
+#define OS_SHARED_STACK_SIZE 0x400 //the stack shared-stack jobs run on. It has to fit the deepest chain of them preempting each other
+
+#if OS_SRP && (OS_SCHED_POLICY != SCHED_EDF || OS_SCHED_DYNAMIC || OS_PARTITIONS > 1)
+#error "SRP needs SCHED_EDF, and can't be used with OS_SCHED_DYNAMIC or partitions"
+#endif
+
+/*
+	Admission control. Timed threads declare a worst-case execution time, and osTimedThreadNew runs the policy's
+	schedulability test on the whole set of timed threads before letting a new one in. Utilizations are fixed point in
+	hundredths of a percent, so OS_UTIL_SCALE is the whole CPU.
+*/
+#define OS_UTIL_SCALE 10000
+#define OS_ADMISSION_REJECT 1 //1 refuses threads that would make the set unschedulable. 0 lets them in and just clears osIsSchedulable()
+
+/*
+	Deadline misses. A timed thread's job that is still running when its deadline comes around has missed it. Since deadlines
+	are implicit that is also when the next job is due, and the thread's miss policy decides what gives:
+
+	MISS_SKIP: the late job carries on and the job that was due now is dropped instead. The late job takes over its release and
+		deadline, so the thread stays on its period grid and only loses one job's worth of work.
+	MISS_ABORT: the late job is thrown away and the thread starts the next job from the top of its function right away.
+		With OS_SRP a thread that uses any mutexes can't have this, since a thrown away job could be holding one.
+	MISS_CALLBACK: the thread's missHandler is called from SysTick, then the job carries on like MISS_SKIP.
+
+	Either way the lateness stops at the thread that was late instead of pushing back every deadline behind it.
+*/
+#define MISS_SKIP 0
+#define MISS_ABORT 1
+#define MISS_CALLBACK 2
+
+/*
+	Mixed criticality, EDF-VD. A timed thread is either low (CRIT_LO) or high (CRIT_HI) criticality, and a high one declares
+	two WCETs: the usual optimistic one, and a pessimistic wcetHi it can never go past. The system starts in low mode, where
+	every thread is trusted to keep to its optimistic WCET and high threads run by a virtual deadline, which is their real one
+	scaled down by the factor admission control works out. That puts them ahead of where EDF would, so they have slack saved
+	up for when it's needed. The first time a high thread goes over its optimistic WCET the kernel switches to high mode:
+	high threads get their real deadlines back and low threads stop getting in the way, until the CPU next goes idle and
+	everything goes back to normal. This way the CPU only has to be provisioned for the pessimistic WCETs of what really matters.
+	Only under SCHED_EDF, and not with OS_SRP, since dropping a job that holds a mutex or is part way up the shared stack can't be undone.
+*/
+#define CRIT_LO 0
+#define CRIT_HI 1
+#define OS_CRIT_LO_PERIOD_SCALE 0 //what low threads do in high mode. 0 suspends them, N keeps them going at N times their period
+
+/*
+	Elastic periods, from Buttazzo's elastic task model. A timed thread that can live with running less often, like telemetry
+	or logging, gives a longest period it can stand and an elasticity. Whenever admission control runs and the timed threads
+	add up to more than the whole CPU, the elastic ones are stretched out like springs to make room, each by an amount
+	that goes with its elasticity, and none of them past its longest period. When the load drops they spring back, all the
+	way to the period they asked for if there is room. The thread's period is always somewhere between the two.
+*/
+#define ELASTIC_RIGID 0 //elasticity of a thread whose period never changes
+
+#define DEFAULT_PRIORITY 0 //asks osThreadNew to work out a priority: RR_PRIORITY for RR threads, rate-monotonic for timed threads
 
 //These are potentially useful constants that can be used when our scheduler is more sophisticated
 #define NO_THREADS 0 //no non-idle threads are running, literally do nothing
@@ -38,34 +198,171 @@
 #define CREATED 0 //created, but not running
 #define ACTIVE 1 //running and active
 #define WAITING 2 //not running but ready to go
-#define DESTROYED 3 //for use later, especially for threads that end. This indicates that a new thread COULD go here if it needs to
+#define DESTROYED 3 //the slot is empty and on the free list, so a new thread COULD go here if it needs to
+#define THROTTLED 4 //used up its CPU budget, so it sits out until the budget is topped up
+#define SUSPENDED 5 //a low criticality thread that sits out high criticality mode
+#define EXITED 6 //the thread is done, and its slot is kept until osThreadJoin collects its exit code
+
+//a slot with no thread in it that can still run. Loops over the slots skip these
+#define THREAD_DONE(status) ((status) == EXITED || (status) == DESTROYED)
 
-//system call numbers
+/*
+	System call numbers. They index the dispatch table in _kernelCore.c, and travel to it in r12 (see osSvcCall) rather than
+	in the SVC instruction, so there is nothing to decode and every call costs the same to get to.
+*/
 #define YIELD_SWITCH 0
 #define SLEEP_SWITCH 1
+#define WAIT_PERIOD_SWITCH 2
+#define SLEEP_UNTIL_SWITCH 3
+#define RESCHEDULE_SWITCH 4
+#define JOB_DONE_SWITCH 5
+#define TICK_COUNT_CALL 6 //the _CALL ones never switch, see OS_FAST_CALLS
+#define MUTEX_ACQUIRE_CALL 7
+#define MUTEX_RELEASE_CALL 8
+#define THREAD_EXIT_SWITCH 9
+#define THREAD_JOIN_SWITCH 10
+#define SVC_CALLS 11 //how many there are, which is the size of the table
+
+/*
+	Set to 1 to let privileged threads run the system calls that never switch threads (the tick count and the mutexes) inline,
+	with interrupts masked, instead of paying for an SVC. Only calls that might switch still trap. 0 traps for everything
+*/
+#define OS_FAST_CALLS 1
+
+//what a system call's handler tells the dispatcher to do once it's done
+#define SVC_RETURN 0 //go straight back to the caller
+#define SVC_SWITCH 1 //save the caller's stack and run the scheduler
+#define SVC_SWITCH_NO_SAVE 2 //run the scheduler, but the caller is never coming back to its stack
 
 
 //The fundamental data structure that is the thread
 typedef struct thread_t{
+	uint32_t* taskStack; //stack pointer for this task. It has to stay first, since PendSV gets to it through a thread pointer with no offset
+	uint32_t* stackBase; //the lowest address of the thread's stack, where its canary is. NULL for a shared-stack thread. PendSV needs this second
 	void (*threadFunction)(void* args);
 	int status;
-	uint32_t* taskStack; //stack pointer for this task
-	uint32_t timeout; //If a thread doesn't yield, it has to timeout. I choose to have a separate timer for each thread
-	uint32_t sleepTimer; //A sleep timer. This is one of the reasons a separate timer for each thread makese sense. Now threads can sleep arbitrarily long
+	uint32_t timeout; //The length of the last timeout this thread asked for
 	uint32_t period; //the period of the thread, used for EDF scheduling and later, the timers
 	bool mutexResources[MAX_THREADS];
+	int threadType; //RR_THREAD, TIMED_THREAD or SERVER_THREAD, which decides whether the thread is scheduled by priority or by deadline
+	uint32_t release; //absolute tick the current job was released at. Only used by timed threads
+	uint32_t deadline; //absolute tick the current job has to be done by. This is the EDF key
+	int heapIndex; //where this thread is in the EDF heap, so that it can be taken out without searching
+	uint32_t priority; //the ready queue level this thread lives on. Used by RR threads, and by every thread in fixed priority mode
+	uint32_t wcet; //worst-case execution time of one job in ticks, declared by timed threads for admission control
+	uint32_t criticality; //CRIT_LO or CRIT_HI. Everything that isn't a timed thread is CRIT_LO
+	uint32_t wcetHi; //the pessimistic WCET of a CRIT_HI thread, which is what it is held to in high mode
+	uint32_t virtualDeadline; //relative deadline in low mode. The EDF-VD one for CRIT_HI threads, the period for everything else
+	uint32_t periodMin; //the period the thread asked for. An elastic thread's period only goes above this when the CPU is overloaded
+	uint32_t periodMax; //the longest an elastic thread's period can be stretched to
+	uint32_t elasticity; //how much of the overload this thread takes compared to the other elastic threads. ELASTIC_RIGID if it isn't elastic
+	uint32_t responseTime; //worst-case response time from the last fixed priority analysis, 0 if it hasn't been worked out
+	uint32_t execTicks; //ticks the current job has been running for. SysTick charges them to whoever it interrupts
+	uint32_t missCount; //jobs that were still running at their deadline
+	uint32_t overrunCount; //jobs that ran longer than wcet
+	uint32_t missPolicy; //MISS_SKIP, MISS_ABORT or MISS_CALLBACK
+	void (*missHandler)(int id); //called from SysTick on a miss when missPolicy is MISS_CALLBACK
+	uint32_t budget; //ticks of CPU this thread may use every budgetPeriod. 0 means no limit. A server's budget works differently, see SERVER_THREAD
+	uint32_t budgetPeriod; //how often the budget is topped back up
+	uint32_t budgetLeft; //what's left of the budget until the next top up
+	uint32_t budgetRelease; //absolute tick of the next top up
+	uint32_t quantum; //how many ticks an RR thread gets to run before the next thread on its level gets a turn
+	uint32_t sliceLeft; //how much of the quantum is left. Only the running thread uses this up
+	uint32_t partition; //which partition's ready structure and windows this thread uses
+	uint32_t preemptThreshold; //only threads with a priority above this can preempt this one. 0 means anything more urgent can
+	uint32_t preemptLevel; //SRP preemption level, higher for shorter periods. 0 for RR threads
+	bool jobStarted; //the current job has been picked to run at least once. SRP only holds jobs back before they start
+	bool sharedStack; //each job runs to completion on the shared stack instead of this thread having a stack of its own
+	int sharedBelow; //the shared-stack job whose frame is under this one's, or NO_THREAD
+	uint32_t stackSize; //how many bytes the stack has, a multiple of 8
+	bool detached; //nobody is going to join this thread, so its slot is freed as soon as it exits
+	int joiner; //the thread waiting in osThreadJoin for this one to exit, or NO_THREAD
+	uint32_t* joinResult; //where the exit code of the thread this one is joining goes. May be NULL
+	uint32_t exitCode; //what the thread passed to osThreadExit, kept while it is EXITED
+	int next; //the next thread on the same ready queue, or NO_THREAD. A DESTROYED slot uses it for the next one on the free list
+	int prev; //the previous thread on the same ready queue, or NO_THREAD. Having both makes removal O(1)
+	uint32_t timerDelta; //ticks between this thread's timeout and the one in front of it in the timer list
+	int timerNext; //the thread that times out after this one, or NO_THREAD
+	int timerPrev; //the thread that times out before this one, or NO_THREAD
 }thread;
 
+/*
+	Optional settings for a new thread. Pass NULL to osThreadNew to get the defaults. Any field left
+	at 0 also gets its default, so you only have to fill in the ones you care about.
+*/
+typedef struct thread_attr_t{
+	uint32_t quantum; //RR time slice in ticks. 0 means RR_TIMEOUT
+	uint32_t priority; //ready queue level, 1 to OS_PRIORITY_LEVELS-1 with higher being more urgent. 0 means DEFAULT_PRIORITY
+	uint32_t missPolicy; //what to do when a job misses its deadline. 0 means MISS_SKIP
+	void (*missHandler)(int id); //needed for MISS_CALLBACK, ignored otherwise
+	uint32_t budget; //CPU reservation in ticks (see US_TO_TICKS) per budgetPeriod. 0 means no limit. RR threads only
+	uint32_t budgetPeriod; //ticks between top ups of the budget. Has to be at least the budget
+	uint32_t partition; //the partition the thread runs in. 0 is the first one, and the only one if partitions are off
+	uint32_t preemptThreshold; //priority a thread has to be above to preempt this one. Has to be at least this thread's priority. 0 means no threshold
+	bool sharedStack; //run every job to completion on the shared stack. Timed threads with OS_SRP only, and not with MISS_ABORT
+	uint32_t criticality; //CRIT_LO or CRIT_HI. Timed threads only, and CRIT_HI needs SCHED_EDF. 0 means CRIT_LO
+	uint32_t wcetHi; //the pessimistic WCET of a CRIT_HI thread, between its WCET and its period. 0 means the same as the WCET
+	uint32_t elasticity; //makes a CRIT_LO timed thread elastic, see ELASTIC_RIGID. Not with OS_SRP or SCHED_TABLE
+	uint32_t periodMax; //the longest period an elastic thread can live with. Has to be at least the period it asks for
+	bool detached; //free the thread's slot as soon as it exits instead of keeping it for osThreadJoin
+	uint32_t stackSize; //bytes of stack, at least STACK_SIZE_MIN and rounded up to 8. 0 means THREAD_STACK_SIZE. Shared-stack threads don't have one
+}threadAttr;
+
+//Context switch counters, see osGetSwitchStats
+typedef struct switch_stats_t{
+	uint32_t switches; //times the scheduler picked a different thread than the one running
+	uint32_t preemptions; //switches away from a thread that could have kept running
+	uint32_t preemptionsAvoided; //wakeups that would have preempted, but were below the running thread's threshold
+	uint32_t sameThread; //times the scheduler kept the thread that was running, so PendSV was skipped altogether
+}switchStats;
+
 //Mutex data structure
 typedef struct mutex_t{
 	bool resourceIsAvailable;
 	int id;
 	int queuedThreads[MAX_THREADS];
 	int currentId;
+	uint32_t ceiling; //SRP: the highest preemption level of any thread that uses this mutex
+	uint32_t previousCeiling; //SRP: the system ceiling from before this mutex was taken, put back when it is released
+	int previousOwner; //SRP: whoever the system ceiling belonged to before this mutex was taken
+	int previousLock; //SRP: the mutex taken before this one, since they have to be released in the opposite order
 }mutex;
 
 
 //creates the idle task, which is what runs when nothing else is available. Use by both threading and kernel libraries
 void createIdleTask(void (*tf)(void*args));
 
+//builds a thread's first stack frame so that switching to it starts its function from the top
+void osThreadStackInit(int id);
+
+//the same, but the frame goes right under "top" instead of at the top of the thread's own stack
+void osThreadStackInitAt(int id, uint32_t* top);
+
+//where a shared-stack job goes when its function returns. It ends the job and never comes back
+void osJobReturn(void);
+
+//where every other thread goes when its function returns. It exits the thread with an exit code of 0
+void osThreadReturn(void);
+
+//puts an EXITED or never-used slot back on the free list
+void osThreadSlotFree(int id);
+
+//empties the stack arena. Called by kernelInit
+void osStackArenaInit(void);
+
+//takes "size" bytes from the stack arena, 8-byte aligned, and returns the lowest address. NULL if there isn't room
+uint32_t* osStackAlloc(uint32_t size);
+
+//gives a stack from osStackAlloc back, merging it with any free space on either side
+void osStackFree(uint32_t* base, uint32_t size);
+
+//starts a new job for a thread: it is released now and its deadline is one period from now
+void osJobRelease(int id);
+
+//arms a thread's timeout so that it expires "ticks" SysTicks from now
+void osTimerInsert(int id, uint32_t ticks);
+
+//disarms a thread's timeout. Does nothing if it isn't armed
+void osTimerRemove(int id);
+
 #endif
@@ -17,6 +17,10 @@
 #include "led.h"
 #include <stdbool.h>
 
+#if OS_BENCHMARK
+#include "bench.h"
+#endif
+
 
 /*
 	Main, or some programmer-defined library, is where the user of your RTOS API 
@@ -81,14 +85,33 @@ int main( void )
 	//Initialize the kernel. We'll need to do this every lab project
 	kernelInit();
 	
+#if OS_BENCHMARK
+	//the benchmarks create their own threads and print their results over UART, so there is nothing else to do
+	bench_scheduler();
+	bench_tick();
+	bench_syscall();
+#if OS_PARTITIONS > 1
+	bench_partition();
+#endif
+	bench_switch(); //starts the kernel, so it never comes back
+	while(1);
+#endif
+	
 	bool task0MutexUse[3] = {true, false, false};
 	bool task1MutexUse[3] = {true, true, false};
 	bool task2MutexUse[3] = {false, true, false};
 	
+	//task2 never yields, so it only gives up the CPU when its quantum runs out. Give it a longer one than the default,
+	//but cap it at 20 ms of every 50 ms so that it can never starve the other two
+	threadAttr task2Attr = {0};
+	task2Attr.quantum = 2*RR_TIMEOUT;
+	task2Attr.budget = US_TO_TICKS(20000);
+	task2Attr.budgetPeriod = 50;
+	
 	//set up my threads
-	osThreadNew(task0, task0MutexUse);
-	osThreadNew(task1, task1MutexUse);
-	osThreadNew(task2, task2MutexUse);
+	osThreadNew(task0, task0MutexUse, NULL);
+	osThreadNew(task1, task1MutexUse, NULL);
+	osThreadNew(task2, task2MutexUse, &task2Attr);
 	
 	//create three mutexes
 	osMutexCreate();
@@ -1,19 +1,61 @@
+;The context switch is all assembly now, unless OS_C_SWITCH is defined for the assembler (in the project's Asm Define box),
+;which builds the old one that calls task_switch in C. That one is only kept around to benchmark the new one against
 	AREA	handle_pend,CODE,READONLY
+	IF :DEF:OS_C_SWITCH
 	EXTERN task_switch ;I am going to call a C function to handle the switching
+	ENDIF
+	EXTERN osCurrentTCB
+	EXTERN osNextTCB
+	EXTERN osStackOverflow
 	GLOBAL PendSV_Handler
 	GLOBAL SVC_Handler
+	GLOBAL osSvcCall
 	PRESERVE8
 PendSV_Handler
 	
+		;SysTick can change who is next, so nothing gets in while we are half way between two threads
+		CPSID I
+		
+	IF :DEF:OS_C_SWITCH
 		MRS r0,PSP
 		
 		;Store the registers
 		STMDB r0!,{r4-r11}
 		
-		;call kernel task switch
+		;call kernel task switch, with where we just put them
 		BL task_switch
 		
 		MRS r0,PSP ;this is the new task stack
+	ELSE
+		MRS r0,PSP
+		LDR r3,=osCurrentTCB
+		LDR r2,[r3] ;the thread we are leaving
+		
+		;if it's NULL, whatever is on the stack isn't coming back, so there is nothing to save
+		CBZ r2,PendSV_Restore
+		
+		;Store the registers, then the stack pointer straight into the thread. taskStack is the first thing in it
+		STMDB r0!,{r4-r11}
+		STR r0,[r2]
+		
+		;stackBase is the second thing, and the canary is the word it points at. If the stack pointer got down to it, or
+		;something wrote over it, the stack overflowed. Shared-stack threads have no stack of their own to check
+		LDR r1,[r2,#4]
+		CBZ r1,PendSV_Restore
+		CMP r0,r1
+		BLS PendSV_Overflow
+		LDR r1,[r1]
+		LDR r12,=0xC0DEC0DE ;STACK_CANARY in osDefs.h
+		CMP r1,r12
+		BNE PendSV_Overflow
+		
+PendSV_Restore
+		;the next thread is the current one from now on, and its saved stack pointer is where we start
+		LDR r1,=osNextTCB
+		LDR r1,[r1]
+		STR r1,[r3]
+		LDR r0,[r1]
+	ENDIF
 		MOV LR,#0xFFFFFFFD ;magic return value to get us back to Thread mode
 		
 		;LoaD Multiple Increment After, basically undo the stack pushes we did before
@@ -22,8 +64,17 @@ PendSV_Handler
 		;Reload PSP. Now that we've popped a bunch, PSP has to be updated
 		MSR PSP,r0
 		
+		CPSIE I
+		
 		;return
 		BX LR
+	
+	IF :LNOT::DEF:OS_C_SWITCH
+PendSV_Overflow
+		;there is no going back to a thread whose stack is trampled, so this never returns
+		MOV r0,r2
+		B osStackOverflow
+	ENDIF
 
 SVC_Handler
 		;We will be calling this function to handle the various system calls
@@ -40,4 +91,13 @@ SVC_Handler
 		
 		B SVC_Handler_Main ;Jump to the C function, which handles the system calls
 
+osSvcCall
+		;The first four arguments are already in r0-r3. The fifth is the call number, which the caller left on top of the stack,
+		;so it goes in r12. The exception entry stacks r0-r3 and r12 for us, and SVC_Handler_Main reads them from there
+		LDR r12,[sp]
+		SVC #0
+		
+		;whatever the system call put in the stacked r0 is in r0 now, which is our return value
+		BX LR
+
 		END
\ No newline at end of file